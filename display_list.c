@@ -0,0 +1,628 @@
+/* wld: display_list.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+enum command_type {
+	COMMAND_FILL,
+	COMMAND_COPY,
+	COMMAND_TEXT,
+	COMMAND_CELLS,
+};
+
+struct command {
+	enum command_type type;
+
+	/**
+	 * Set for commands whose pixels are all drawn over by later commands
+	 * before anything reads them.
+	 */
+	bool culled;
+
+	/**
+	 * For fills, the region to fill, and for copies, the region of the
+	 * source to copy. For text and cells, the bounds of the pixels they
+	 * may draw.
+	 */
+	pixman_region32_t region;
+
+	uint32_t color;
+	int32_t x, y;
+	struct buffer *buffer;
+	struct font *font;
+	struct text_run *run;
+	float scale;
+
+	/**
+	 * Set for the runs after the first of a single wld_draw_text_runs, which
+	 * are drawn together with it.
+	 */
+	bool continues;
+
+	struct wld_cell *cells;
+	uint32_t columns, rows;
+};
+
+struct display_list {
+	struct command *commands;
+	uint32_t num_commands, max_commands;
+
+	/**
+	 * Space for gathering the runs of a wld_draw_text_runs, which is made
+	 * large enough as they are recorded.
+	 */
+	struct wld_text_run *runs;
+	uint32_t max_runs;
+};
+
+static struct command *
+add_command(struct display_list *list, enum command_type type)
+{
+	struct command *commands, *command;
+	uint32_t max_commands;
+
+	if (list->num_commands == list->max_commands) {
+		max_commands = list->max_commands ? list->max_commands * 2 : 64;
+		commands = realloc(list->commands,
+		                   max_commands * sizeof commands[0]);
+
+		if (!commands)
+			return NULL;
+
+		list->commands = commands;
+		list->max_commands = max_commands;
+	}
+
+	command = &list->commands[list->num_commands++];
+	command->type = type;
+	command->culled = false;
+	command->buffer = NULL;
+	command->font = NULL;
+	command->run = NULL;
+	command->continues = false;
+	command->cells = NULL;
+
+	return command;
+}
+
+static void
+release_command(struct command *command)
+{
+	pixman_region32_fini(&command->region);
+
+	if (command->buffer)
+		wld_buffer_unreference(&command->buffer->base);
+
+	if (command->run)
+		text_run_release(command->run);
+
+	if (command->font)
+		wld_font_close(&command->font->base);
+
+	free(command->cells);
+}
+
+bool
+display_list_create(struct wld_renderer *renderer)
+{
+	struct display_list *list;
+
+	if (!(list = malloc(sizeof *list)))
+		return false;
+
+	list->commands = NULL;
+	list->num_commands = 0;
+	list->max_commands = 0;
+	list->runs = NULL;
+	list->max_runs = 0;
+	renderer->display_list = list;
+
+	return true;
+}
+
+void
+display_list_destroy(struct wld_renderer *renderer)
+{
+	struct display_list *list = renderer->display_list;
+	uint32_t index;
+
+	for (index = 0; index < list->num_commands; ++index)
+		release_command(&list->commands[index]);
+
+	free(list->commands);
+	free(list->runs);
+	free(list);
+	renderer->display_list = NULL;
+}
+
+void
+display_list_fill_region(struct wld_renderer *renderer, uint32_t color,
+                         pixman_region32_t *region)
+{
+	struct command *command;
+
+	if (!(command = add_command(renderer->display_list, COMMAND_FILL)))
+		goto error0;
+
+	pixman_region32_init(&command->region);
+
+	if (!pixman_region32_copy(&command->region, region))
+		goto error1;
+
+	command->color = color;
+
+	return;
+
+error1:
+	pixman_region32_fini(&command->region);
+	--renderer->display_list->num_commands;
+error0:
+	/* Without the memory to record the fill, draw it right away. */
+	display_list_execute(renderer);
+	renderer->impl->fill_region(renderer, color, region);
+}
+
+void
+display_list_copy_region(struct wld_renderer *renderer, struct buffer *buffer,
+                         int32_t dst_x, int32_t dst_y,
+                         pixman_region32_t *region)
+{
+	struct command *command;
+
+	if (!(command = add_command(renderer->display_list, COMMAND_COPY)))
+		goto error0;
+
+	pixman_region32_init(&command->region);
+
+	if (!pixman_region32_copy(&command->region, region))
+		goto error1;
+
+	wld_buffer_reference(&buffer->base);
+	command->buffer = buffer;
+	command->x = dst_x;
+	command->y = dst_y;
+
+	return;
+
+error1:
+	pixman_region32_fini(&command->region);
+	--renderer->display_list->num_commands;
+error0:
+	display_list_execute(renderer);
+	renderer->impl->copy_region(renderer, buffer, dst_x, dst_y, region);
+}
+
+static inline int32_t
+scale_offset(int32_t offset, float scale)
+{
+	return (int32_t)(offset * scale) + (offset < 0 ? -1 : 1);
+}
+
+static bool
+add_text(struct wld_renderer *renderer, struct font *font, uint32_t color,
+         int32_t x, int32_t y, float scale, struct text_run *run,
+         bool continues)
+{
+	struct command *command;
+	const struct box *bounds = &run->bounds;
+	int32_t last_x;
+
+	if (!(command = add_command(renderer->display_list, COMMAND_TEXT)))
+		return false;
+
+	last_x = run->num_glyphs > 0 ? run->glyphs[run->num_glyphs - 1].x : 0;
+	pixman_region32_init_rect(&command->region,
+	                          x + scale_offset(bounds->x1, scale),
+	                          y + scale_offset(bounds->y1, scale),
+	                          scale_offset(last_x + bounds->x2, scale)
+	                              - scale_offset(bounds->x1, scale),
+	                          scale_offset(bounds->y2, scale)
+	                              - scale_offset(bounds->y1, scale));
+	font_reference(font);
+	command->font = font;
+	command->run = run;
+	command->color = color;
+	command->x = x;
+	command->y = y;
+	command->scale = scale;
+	command->continues = continues;
+
+	return true;
+}
+
+/**
+ * Make room for gathering the given number of runs when the list is drawn.
+ */
+static bool
+reserve_runs(struct display_list *list, uint32_t num_runs)
+{
+	struct wld_text_run *runs;
+
+	if (num_runs <= list->max_runs)
+		return true;
+
+	if (!(runs = realloc(list->runs, num_runs * sizeof runs[0])))
+		return false;
+
+	list->runs = runs;
+	list->max_runs = num_runs;
+
+	return true;
+}
+
+void
+display_list_draw_text(struct wld_renderer *renderer, struct font *font,
+                       uint32_t color, int32_t x, int32_t y, float scale,
+                       const char *text, uint32_t length,
+                       struct wld_extents *extents)
+{
+	struct text_run *run;
+
+	if (scale == 1 && !reserve_runs(renderer->display_list, 1))
+		goto error0;
+
+	if (!(run = font_text_run(font, text, length)))
+		goto error0;
+
+	if (extents)
+		extents->advance = run->advance * scale + 0.5f;
+
+	/* Runs without glyphs draw nothing. */
+	if (run->num_glyphs == 0) {
+		text_run_release(run);
+		return;
+	}
+
+	if (!add_text(renderer, font, color, x, y, scale, run, false))
+		goto error1;
+
+	return;
+
+error1:
+	text_run_release(run);
+error0:
+	display_list_execute(renderer);
+	font_begin_draw(font);
+
+	if (font->mode == FONT_RENDER_SDF) {
+		renderer->impl->draw_text_scaled(renderer, font, color, x, y, scale,
+		                                 text, length, extents);
+	} else {
+		renderer->impl->draw_text(renderer, font, color, x, y,
+		                          text, length, extents);
+	}
+
+	font_end_draw(font);
+}
+
+void
+display_list_draw_text_runs(struct wld_renderer *renderer, struct font *font,
+                            const struct wld_text_run *runs,
+                            uint32_t num_runs)
+{
+	struct display_list *list = renderer->display_list;
+	struct text_run *run;
+	uint32_t index, count = 0;
+
+	if (!reserve_runs(list, num_runs))
+		goto error0;
+
+	for (index = 0; index < num_runs; ++index) {
+		if (!(run = font_text_run(font, runs[index].text, runs[index].length)))
+			goto error0;
+
+		if (run->num_glyphs == 0) {
+			text_run_release(run);
+			continue;
+		}
+
+		if (!add_text(renderer, font, runs[index].color, runs[index].x,
+		              runs[index].y, 1, run, count > 0)) {
+			text_run_release(run);
+			goto error0;
+		}
+
+		++count;
+	}
+
+	return;
+
+error0:
+	/* Drop the runs recorded so far and draw them all right away. */
+	for (; count > 0; --count)
+		release_command(&list->commands[--list->num_commands]);
+
+	display_list_execute(renderer);
+	font_begin_draw(font);
+	draw_text_runs(renderer, font, runs, num_runs);
+	font_end_draw(font);
+}
+
+void
+display_list_draw_cells(struct wld_renderer *renderer, struct font *font,
+                        int32_t x, int32_t y, const struct wld_cell *cells,
+                        uint32_t columns, uint32_t rows)
+{
+	struct command *command;
+	size_t size;
+
+	if (columns == 0 || rows == 0)
+		return;
+
+	if (!(command = add_command(renderer->display_list, COMMAND_CELLS)))
+		goto error0;
+
+	size = array_size(array_size(columns, rows), sizeof cells[0]);
+
+	if (!(command->cells = malloc(size)))
+		goto error1;
+
+	memcpy(command->cells, cells, size);
+	pixman_region32_init_rect(&command->region, x, y,
+	                          columns * font->base.max_advance,
+	                          rows * font->base.height);
+	font_reference(font);
+	command->font = font;
+	command->x = x;
+	command->y = y;
+	command->columns = columns;
+	command->rows = rows;
+
+	return;
+
+error1:
+	--renderer->display_list->num_commands;
+error0:
+	display_list_execute(renderer);
+	font_begin_draw(font);
+
+	if (font->mode == FONT_RENDER_SDF)
+		default_draw_cells(renderer, font, x, y, cells, columns, rows);
+	else
+		renderer->impl->draw_cells(renderer, font, x, y, cells, columns, rows);
+
+	font_end_draw(font);
+}
+
+/**
+ * Cull the commands whose pixels are all drawn over before they are read.
+ *
+ * Going from the last command to the first, covered holds the pixels which
+ * are written by later commands before anything reads them. Fills, copies and
+ * the backgrounds of cells write every pixel they touch, while text blends
+ * with the pixels under it, and so reads them. All the commands are drawn
+ * to the same target with the same clip, if any, so only the pixels inside
+ * it are touched.
+ */
+static void
+cull_commands(struct display_list *list, struct buffer *target,
+              const pixman_region32_t *clip)
+{
+	pixman_region32_t covered, region;
+	struct command *command;
+	uint32_t index;
+
+	pixman_region32_init(&covered);
+	pixman_region32_init(&region);
+
+	for (index = list->num_commands; index-- > 0;) {
+		command = &list->commands[index];
+
+		switch (command->type) {
+		case COMMAND_FILL:
+			pixman_region32_copy(&region, &command->region);
+			break;
+		case COMMAND_COPY:
+			/* Pixman copies nothing from outside the source. */
+			pixman_region32_intersect_rect(&region, &command->region, 0, 0,
+			                               command->buffer->base.width,
+			                               command->buffer->base.height);
+			pixman_region32_translate(&region, command->x, command->y);
+			break;
+		case COMMAND_TEXT:
+			pixman_region32_copy(&region, &command->region);
+			break;
+		case COMMAND_CELLS:
+			/* The backgrounds cover the cells, but their glyphs may come
+			 * from fallback fonts which aren't loaded until they are drawn,
+			 * so they may reach anywhere past the cells, blending with the
+			 * pixels there. Cells are always drawn, and only the pixels
+			 * inside them stay covered. */
+			pixman_region32_copy(&covered, &command->region);
+
+			if (clip)
+				pixman_region32_intersect(&covered, &covered, clip);
+
+			continue;
+		}
+
+		if (clip)
+			pixman_region32_intersect(&region, &region, clip);
+
+		if (!pixman_region32_not_empty(&region)
+		    || pixman_region32_contains_rectangle(&covered, &region.extents)
+		           == PIXMAN_REGION_IN) {
+			command->culled = true;
+			continue;
+		}
+
+		switch (command->type) {
+		case COMMAND_FILL:
+			pixman_region32_union(&covered, &covered, &region);
+			break;
+		case COMMAND_COPY:
+			pixman_region32_union(&covered, &covered, &region);
+
+			/* A copy within the target reads the pixels it copies. */
+			if (command->buffer == target) {
+				pixman_region32_subtract(&covered, &covered,
+				                         &command->region);
+			}
+			break;
+		case COMMAND_TEXT:
+			pixman_region32_subtract(&covered, &covered, &region);
+			break;
+		case COMMAND_CELLS:
+			break;
+		}
+	}
+
+	pixman_region32_fini(&region);
+	pixman_region32_fini(&covered);
+}
+
+/**
+ * Draw a fill, along with the fills of the same color that follow it, and
+ * return the index of the next command.
+ */
+static uint32_t
+execute_fills(struct wld_renderer *renderer, uint32_t index)
+{
+	struct display_list *list = renderer->display_list;
+	struct command *command = &list->commands[index], *next;
+
+	for (++index; index < list->num_commands; ++index) {
+		next = &list->commands[index];
+
+		if (next->culled)
+			continue;
+
+		if (next->type != COMMAND_FILL || next->color != command->color)
+			break;
+
+		pixman_region32_union(&command->region, &command->region,
+		                      &next->region);
+	}
+
+	renderer->impl->fill_region(renderer, command->color, &command->region);
+
+	return index;
+}
+
+/**
+ * Draw a run of text, along with the rest of the runs of the same
+ * wld_draw_text_runs, and return the index of the next command.
+ */
+static uint32_t
+execute_text(struct wld_renderer *renderer, uint32_t index)
+{
+	struct display_list *list = renderer->display_list;
+	struct command *command = &list->commands[index], *next;
+	uint32_t num_runs = 0;
+
+	if (command->scale != 1) {
+		if (!command->culled) {
+			font_begin_draw(command->font);
+			renderer->impl->draw_text_scaled(renderer, command->font,
+			                                 command->color,
+			                                 command->x, command->y,
+			                                 command->scale,
+			                                 command->run->text,
+			                                 command->run->length, NULL);
+			font_end_draw(command->font);
+		}
+
+		return index + 1;
+	}
+
+	/* The first run may be culled while later ones are not. */
+	do {
+		next = &list->commands[index];
+
+		if (next->culled)
+			continue;
+
+		list->runs[num_runs].x = next->x;
+		list->runs[num_runs].y = next->y;
+		list->runs[num_runs].color = next->color;
+		list->runs[num_runs].text = next->run->text;
+		list->runs[num_runs].length = next->run->length;
+		++num_runs;
+	} while (++index < list->num_commands
+	         && list->commands[index].continues);
+
+	if (num_runs > 0) {
+		font_begin_draw(command->font);
+		draw_text_runs(renderer, command->font, list->runs, num_runs);
+		font_end_draw(command->font);
+	}
+
+	return index;
+}
+
+void
+display_list_execute(struct wld_renderer *renderer)
+{
+	struct display_list *list = renderer->display_list;
+	struct command *command;
+	uint32_t index;
+
+	cull_commands(list, (struct buffer *)renderer->target,
+	              renderer->clipped ? &renderer->clip : NULL);
+
+	for (index = 0; index < list->num_commands;) {
+		command = &list->commands[index];
+
+		if (command->culled && command->type != COMMAND_TEXT) {
+			++index;
+			continue;
+		}
+
+		switch (command->type) {
+		case COMMAND_FILL:
+			index = execute_fills(renderer, index);
+			break;
+		case COMMAND_COPY:
+			renderer->impl->copy_region(renderer, command->buffer,
+			                            command->x, command->y,
+			                            &command->region);
+			++index;
+			break;
+		case COMMAND_TEXT:
+			index = execute_text(renderer, index);
+			break;
+		case COMMAND_CELLS:
+			font_begin_draw(command->font);
+
+			if (command->font->mode == FONT_RENDER_SDF) {
+				default_draw_cells(renderer, command->font,
+				                   command->x, command->y, command->cells,
+				                   command->columns, command->rows);
+			} else {
+				renderer->impl->draw_cells(renderer, command->font,
+				                           command->x, command->y,
+				                           command->cells,
+				                           command->columns, command->rows);
+			}
+
+			font_end_draw(command->font);
+			++index;
+			break;
+		}
+	}
+
+	for (index = 0; index < list->num_commands; ++index)
+		release_command(&list->commands[index]);
+
+	list->num_commands = 0;
+}
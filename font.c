@@ -23,7 +23,16 @@
 
 #include "wld-private.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <fontconfig/fcfreetype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include FT_MODULE_H
+#include FT_SIZES_H
+
+static uint64_t next_font_id;
 
 EXPORT
 struct wld_font_context *
@@ -42,6 +51,24 @@ wld_font_create_context()
 		goto error1;
 	}
 
+#if HAVE_FT_SDF
+	/* Distance fields cover FONT_SDF_SPREAD pixels on each side of the
+	 * outline, whether they come from outlines or bitmaps. */
+	FT_Property_Set(context->library, "sdf", "spread",
+	                &(FT_Int){FONT_SDF_SPREAD});
+	FT_Property_Set(context->library, "bsdf", "spread",
+	                &(FT_Int){FONT_SDF_SPREAD});
+#endif
+
+	pthread_mutex_init(&context->lock, NULL);
+	context->cache_directory = NULL;
+	text_run_cache_initialize(&context->run_cache);
+	context->faces = NULL;
+	context->fonts = NULL;
+	font_name_cache_initialize(&context->name_cache);
+	context->pending = 0;
+	pthread_cond_init(&context->idle, NULL);
+
 	return context;
 
 error1:
@@ -54,177 +81,1827 @@ EXPORT
 void
 wld_font_destroy_context(struct wld_font_context *context)
 {
+	/* Wait for any fonts still being opened in the background. */
+	pthread_mutex_lock(&context->lock);
+
+	while (context->pending > 0)
+		pthread_cond_wait(&context->idle, &context->lock);
+
+	pthread_mutex_unlock(&context->lock);
+
+	font_name_cache_finalize(&context->name_cache);
+	text_run_cache_finalize(&context->run_cache);
 	FT_Done_FreeType(context->library);
+	pthread_mutex_destroy(&context->lock);
+	pthread_cond_destroy(&context->idle);
+	free(context->cache_directory);
 	free(context);
 }
 
 EXPORT
-struct wld_font *
-wld_font_open_name(struct wld_font_context *context, const char *name)
+bool
+wld_font_set_cache_directory(struct wld_font_context *context,
+                             const char *path)
+{
+	char *directory = NULL;
+
+	if (path) {
+		if (!(directory = strdup(path)))
+			return false;
+
+		if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+			free(directory);
+			return false;
+		}
+	}
+
+	free(context->cache_directory);
+	context->cache_directory = directory;
+
+	return true;
+}
+
+static enum font_render_mode
+pattern_render_mode(FcPattern *pattern)
+{
+	FcBool antialias;
+
+	if (FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &antialias) == FcResultMatch
+	    && antialias) {
+		return FONT_RENDER_GRAY;
+	}
+
+	return FONT_RENDER_MONO;
+}
+
+/**
+ * The font file, face index, size and render mode of a font, which are
+ * enough to tell whether an open font can be shared.
+ */
+struct font_key {
+	const char *filename;
+	int index;
+	double pixel_size, aspect;
+	FT_F26Dot6 width, height;
+	enum font_render_mode mode;
+};
+
+/**
+ * Get the key of a font opened from the given pattern. Returns false if the
+ * pattern doesn't name a font file.
+ */
+static bool
+pattern_key(FcPattern *pattern, enum font_render_mode mode,
+            struct font_key *key)
 {
-	FcPattern *pattern, *match;
 	FcResult result;
 
-	DEBUG("Opening font with name: %s\n", name);
+	result = FcPatternGetString(pattern, FC_FILE, 0,
+	                            (FcChar8 **)&key->filename);
 
-	pattern = FcNameParse((const FcChar8 *)name);
-	FcConfigSubstitute(NULL, pattern, FcMatchPattern);
-	FcDefaultSubstitute(pattern);
+	if (result != FcResultMatch)
+		key->filename = NULL;
 
-	match = FcFontMatch(NULL, pattern, &result);
+	result = FcPatternGetInteger(pattern, FC_INDEX, 0, &key->index);
 
-	if (!match)
-		return NULL;
+	if (result != FcResultMatch)
+		key->index = 0;
+
+	result = FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &key->pixel_size);
 
-	return wld_font_open_pattern(context, match);
+	if (result != FcResultMatch)
+		key->pixel_size = 0;
+
+	result = FcPatternGetDouble(pattern, FC_ASPECT, 0, &key->aspect);
+
+	if (result != FcResultMatch)
+		key->aspect = 1.0;
+
+	key->width = ((unsigned int)key->pixel_size) << 6;
+	key->height = ((unsigned int)(key->pixel_size * key->aspect)) << 6;
+	key->mode = mode;
+
+	return key->filename != NULL;
 }
 
-EXPORT
-struct wld_font *
-wld_font_open_pattern(struct wld_font_context *context, FcPattern *match)
+static bool
+font_has_key(struct font *font, const struct font_key *key)
+{
+	return font->font_face->filename
+	       && strcmp(font->font_face->filename, key->filename) == 0
+	       && font->font_face->index == key->index
+	       && font->char_width == key->width
+	       && font->char_height == key->height
+	       && font->mode == key->mode;
+}
+
+/**
+ * Find an open font with the given key, or if font_name is not NULL, opened
+ * with the given name, and take a reference to it. The context lock must be
+ * held.
+ */
+static struct font *
+find_font(struct wld_font_context *context,
+          const struct font_key *key, struct font_name *font_name)
+{
+	struct font *font;
+
+	for (font = context->fonts; font; font = font->next) {
+		if (font_name ? font->font_name == font_name && font->mode == key->mode
+		              : !font->font_name && font_has_key(font, key)) {
+			++font->ref;
+			return font;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Add a newly opened font to the context's font list so that it can be
+ * shared. If another thread added the same font in the meantime, the new
+ * font is closed, and the other one is returned instead.
+ */
+static struct font *
+register_font(struct font *font)
+{
+	struct wld_font_context *context = font->context;
+	struct font_key key = {
+		.filename = font->font_face->filename,
+		.index = font->font_face->index,
+		.width = font->char_width,
+		.height = font->char_height,
+		.mode = font->mode,
+	};
+	struct font *other;
+
+	/* Faces from FC_FT_FACE are not shared, and neither are their fonts. */
+	if (!key.filename)
+		return font;
+
+	pthread_mutex_lock(&context->lock);
+
+	if (!(other = find_font(context, &key, font->font_name))) {
+		font->registered = true;
+		font->next = context->fonts;
+		context->fonts = font;
+	}
+
+	pthread_mutex_unlock(&context->lock);
+
+	if (other) {
+		wld_font_close(&font->base);
+		return other;
+	}
+
+	return font;
+}
+
+static bool
+map_font_file(struct font_face *font_face, const char *filename)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+		goto error0;
+
+	font_face->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (font_face->map == MAP_FAILED)
+		goto error0;
+
+	close(fd);
+	font_face->map_size = st.st_size;
+
+	return true;
+
+error0:
+	close(fd);
+	return false;
+}
+
+/**
+ * Get the shared face for a font file, opening it if necessary. The context
+ * lock must be held.
+ */
+static struct font_face *
+acquire_face(struct wld_font_context *context,
+             const char *filename, int index)
+{
+	struct font_face *font_face;
+
+	for (font_face = context->faces; font_face; font_face = font_face->next) {
+		if (strcmp(font_face->filename, filename) == 0
+		    && font_face->index == index) {
+			++font_face->ref;
+			return font_face;
+		}
+	}
+
+	DEBUG("Loading font file: %s\n", filename);
+
+	if (!(font_face = malloc(sizeof *font_face)))
+		goto error0;
+
+	if (!(font_face->filename = strdup(filename)))
+		goto error1;
+
+	/* FreeType may read the file into memory of its own, so map it instead,
+	 * which lets the page cache back the font data. */
+	if (!map_font_file(font_face, filename))
+		goto error2;
+
+	if (FT_New_Memory_Face(context->library, font_face->map,
+	                       font_face->map_size, index,
+	                       &font_face->face) != 0) {
+		goto error3;
+	}
+
+	font_face->index = index;
+	font_face->ref = 1;
+	pthread_mutex_init(&font_face->lock, NULL);
+	font_face->next = context->faces;
+	context->faces = font_face;
+
+	return font_face;
+
+error3:
+	munmap(font_face->map, font_face->map_size);
+error2:
+	free(font_face->filename);
+error1:
+	free(font_face);
+error0:
+	return NULL;
+}
+
+static void
+release_face(struct wld_font_context *context, struct font_face *font_face)
+{
+	struct font_face **link;
+
+	pthread_mutex_lock(&context->lock);
+
+	if (--font_face->ref > 0) {
+		pthread_mutex_unlock(&context->lock);
+		return;
+	}
+
+	if (font_face->filename) {
+		for (link = &context->faces; *link != font_face;
+		     link = &(*link)->next) {
+		}
+
+		*link = font_face->next;
+	}
+
+	FT_Done_Face(font_face->face);
+	pthread_mutex_unlock(&context->lock);
+
+	if (font_face->map)
+		munmap(font_face->map, font_face->map_size);
+
+	pthread_mutex_destroy(&font_face->lock);
+	free(font_face->filename);
+	free(font_face);
+}
+
+/**
+ * Set the font's ink bounds from the bounding box of the face. Hinting, and
+ * glyphs which stray outside the bounding box the face claims, can put ink
+ * a few pixels past it, so half a cell is added on each side. Bitmap faces
+ * have no reliable bounding box, so their cells are used instead.
+ */
+static void
+set_bounds(struct font *font)
+{
+	const FT_BBox *bbox = &font->face->bbox;
+	FT_Fixed x_scale = font->size->metrics.x_scale,
+	         y_scale = font->size->metrics.y_scale;
+	int32_t margin_x = (font->base.max_advance + 1) / 2 + 1,
+	        margin_y = (font->base.height + 1) / 2 + 1;
+
+	if (font->face->face_flags & FT_FACE_FLAG_SCALABLE) {
+		font->bounds.x1 = FT_MulFix(bbox->xMin, x_scale) >> 6;
+		font->bounds.x2 = (FT_MulFix(bbox->xMax, x_scale) + 63) >> 6;
+		font->bounds.y1 = -((FT_MulFix(bbox->yMax, y_scale) + 63) >> 6);
+		font->bounds.y2 = -(FT_MulFix(bbox->yMin, y_scale) >> 6);
+	} else {
+		font->bounds.x1 = 0;
+		font->bounds.x2 = font->base.max_advance;
+		font->bounds.y1 = -(int32_t)font->base.ascent;
+		font->bounds.y2 = font->base.descent;
+	}
+
+	/* Distance fields extend past the outline by the spread. */
+	if (font->mode == FONT_RENDER_SDF) {
+		margin_x += FONT_SDF_SPREAD;
+		margin_y += FONT_SDF_SPREAD;
+	}
+
+	font->bounds.x1 -= margin_x;
+	font->bounds.y1 -= margin_y;
+	font->bounds.x2 += margin_x;
+	font->bounds.y2 += margin_y;
+}
+
+static struct font *
+open_font(struct wld_font_context *context, FcPattern *match,
+          enum font_render_mode mode)
 {
-	char *filename;
 	struct font *font;
+	struct font_key key;
 	FcResult result;
-	double pixel_size, aspect;
+	FT_Face face;
 
 	font = malloc(sizeof *font);
 
 	if (!font)
 		goto error0;
 
+	font->id = __atomic_add_fetch(&next_font_id, 1, __ATOMIC_RELAXED);
 	font->context = context;
+	font->font_face = NULL;
 
-	result = FcPatternGetString(match, FC_FILE, 0, (FcChar8 **)&filename);
+	if (pattern_key(match, mode, &key)) {
+		pthread_mutex_lock(&context->lock);
+		font->font_face = acquire_face(context, key.filename, key.index);
+		pthread_mutex_unlock(&context->lock);
+	}
 
-	if (result == FcResultMatch) {
-		FT_Error error;
+	if (!font->font_face) {
+		key.filename = NULL;
+		result = FcPatternGetFTFace(match, FC_FT_FACE, 0, &face);
 
-		DEBUG("Loading font file: %s\n", filename);
+		if (result != FcResultMatch) {
+			DEBUG("Couldn't determine font filename or FreeType face\n");
+			goto error1;
+		}
 
-		error = FT_New_Face(context->library, filename, 0, &font->face);
+		if (!(font->font_face = malloc(sizeof *font->font_face)))
+			goto error1;
 
-		if (error == 0)
-			goto load_face;
+		font->font_face->face = face;
+		font->font_face->filename = NULL;
+		font->font_face->index = key.index;
+		font->font_face->map = NULL;
+		font->font_face->ref = 1;
+		pthread_mutex_init(&font->font_face->lock, NULL);
 	}
 
-	result = FcPatternGetFTFace(match, FC_FT_FACE, 0, &font->face);
+	font->face = font->font_face->face;
+	font->mode = mode;
 
-	if (result != FcResultMatch) {
-		DEBUG("Couldn't determine font filename or FreeType face\n");
-		goto error1;
+	switch (mode) {
+	case FONT_RENDER_MONO:
+		font->load_flags = FT_LOAD_RENDER | FT_LOAD_MONOCHROME
+		                   | FT_LOAD_TARGET_MONO;
+		break;
+	case FONT_RENDER_GRAY:
+		font->load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_NORMAL;
+		break;
+	case FONT_RENDER_SDF:
+		/* Distance fields are drawn at any size, so hinting for the
+		 * reference size would only distort them. They are rendered by
+		 * load_bitmap, since FT_LOAD_RENDER can't select the SDF mode. */
+		font->load_flags = FT_LOAD_NO_HINTING;
+		break;
 	}
 
-load_face:
-	result = FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &pixel_size);
-
-	result = FcPatternGetDouble(match, FC_ASPECT, 0, &aspect);
+	font->char_width = key.width;
+	font->char_height = key.height;
 
-	if (result == FcResultNoMatch)
-		aspect = 1.0;
+	/* Each font has its own size object, so that one face can be shared by
+	 * fonts of different sizes. */
+	pthread_mutex_lock(&font->font_face->lock);
 
-	if (font->face->face_flags & FT_FACE_FLAG_SCALABLE) {
-		FT_F26Dot6 width, height;
+	if (FT_New_Size(font->face, &font->size) != 0) {
+		pthread_mutex_unlock(&font->font_face->lock);
+		goto error2;
+	}
 
-		width = ((unsigned int)pixel_size) << 6;
-		height = ((unsigned int)(pixel_size * aspect)) << 6;
+	FT_Activate_Size(font->size);
 
-		FT_Set_Char_Size(font->face, width, height, 0, 0);
+	if (font->face->face_flags & FT_FACE_FLAG_SCALABLE) {
+		FT_Set_Char_Size(font->face, key.width, key.height, 0, 0);
 	} else {
-		FT_Set_Pixel_Sizes(font->face, (unsigned int)pixel_size,
-		                   (unsigned int)(pixel_size * aspect));
+		FT_Set_Pixel_Sizes(font->face, key.width >> 6, key.height >> 6);
 	}
 
-	font->base.ascent = font->face->size->metrics.ascender >> 6;
-	font->base.descent = -font->face->size->metrics.descender >> 6;
+	pthread_mutex_unlock(&font->font_face->lock);
+
+	font->base.ascent = font->size->metrics.ascender >> 6;
+	font->base.descent = -font->size->metrics.descender >> 6;
 	font->base.height = font->base.ascent + font->base.descent;
-	font->base.max_advance = font->face->size->metrics.max_advance >> 6;
+	font->base.max_advance = font->size->metrics.max_advance >> 6;
+	set_bounds(font);
 
-	font->glyphs = calloc(font->face->num_glyphs, sizeof(struct glyph *));
+	font->num_glyph_pages = (font->face->num_glyphs + GLYPH_PAGE_SIZE - 1)
+	                        >> GLYPH_PAGE_SHIFT;
+	font->glyph_pages = calloc(font->num_glyph_pages,
+	                           sizeof font->glyph_pages[0]);
 
-	return &font->base;
+	if (!font->glyph_pages)
+		goto error3;
+
+	font->atlas.pages = NULL;
+	font->atlas.size = 0;
+	font->atlas.max_size = SIZE_MAX;
+	FT_Bitmap_New(&font->convert_bitmap);
+	font->char_cache.direct = NULL;
+	font->char_cache.table = NULL;
+	font->char_cache.count = 0;
+	FcPatternReference(match);
+	font->match = match;
+	font->mono = NULL;
+	font->pattern = NULL;
+	font->fallback_set = NULL;
+	font->fallbacks = NULL;
+	font->num_fallbacks = 0;
+	font->ref = 1;
+	font->registered = false;
+	font->font_name = NULL;
+	pthread_mutex_init(&font->lock, NULL);
+	font->parent = NULL;
+	pthread_rwlock_init(&font->draw_lock, NULL);
+	font->clock = 0;
+	font->over_budget = false;
+	pthread_mutex_init(&font->prepare.lock, NULL);
+	font->prepare.running = false;
+
+	font_cache_initialize(&font->cache);
+
+	if (key.filename) {
+		font_cache_open(font, key.filename, key.index,
+		                key.pixel_size, key.aspect);
+	}
+
+	return font;
 
+error3:
+	pthread_mutex_lock(&font->font_face->lock);
+	FT_Done_Size(font->size);
+	pthread_mutex_unlock(&font->font_face->lock);
+error2:
+	release_face(context, font->font_face);
 error1:
 	free(font);
 error0:
 	return NULL;
 }
 
+static struct wld_font *
+open_pattern(struct wld_font_context *context, FcPattern *match,
+             enum font_render_mode mode)
+{
+	struct font_key key;
+	struct font *font = NULL;
+
+	if (pattern_key(match, mode, &key)) {
+		pthread_mutex_lock(&context->lock);
+		font = find_font(context, &key, NULL);
+		pthread_mutex_unlock(&context->lock);
+	}
+
+	if (!font) {
+		if (!(font = open_font(context, match, mode)))
+			return NULL;
+
+		font = register_font(font);
+	}
+
+	return &font->base;
+}
+
 EXPORT
-void
-wld_font_close(struct wld_font *font_base)
+struct wld_font *
+wld_font_open_pattern(struct wld_font_context *context, FcPattern *match)
 {
-	struct font *font = (void *)font_base;
+	return open_pattern(context, match, pattern_render_mode(match));
+}
 
-	FT_Done_Face(font->face);
-	free(font);
+EXPORT
+struct wld_font *
+wld_font_open_pattern_sdf(struct wld_font_context *context, FcPattern *match)
+{
+#if HAVE_FT_SDF
+	return open_pattern(context, match, FONT_RENDER_SDF);
+#else
+	DEBUG("FreeType is too old to render distance fields\n");
+
+	return NULL;
+#endif
 }
 
-bool
-font_ensure_glyph(struct font *font, FT_UInt glyph_index)
+/**
+ * Open a font from a fontconfig pattern string with the given render mode, or
+ * if mode is NULL, the mode its match asks for.
+ */
+static struct wld_font *
+open_name(struct wld_font_context *context, const char *name,
+          const enum font_render_mode *mode)
 {
-	if (glyph_index) {
-		if (!font->glyphs[glyph_index]) {
-			struct glyph *glyph;
+	struct font_name *font_name;
+	struct font_key key;
+	struct font *font, **fallbacks;
+	uint32_t num_fallbacks;
 
-			glyph = malloc(sizeof *glyph);
+	if (!(font_name = font_name_resolve(context, name)))
+		return NULL;
 
-			if (!glyph)
-				return false;
+	key.mode = mode ? *mode : pattern_render_mode(font_name->match);
+	pthread_mutex_lock(&context->lock);
+	font = find_font(context, &key, font_name);
+	pthread_mutex_unlock(&context->lock);
 
-			FT_Load_Glyph(font->face, glyph_index, FT_LOAD_RENDER | FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO);
+	if (font) {
+		font_name_release(context, font_name);
+		return &font->base;
+	}
 
-			FT_Bitmap_New(&glyph->bitmap);
+	DEBUG("Opening font with name: %s\n", name);
 
-			FT_Bitmap_Copy(font->context->library,
-			               &font->face->glyph->bitmap, &glyph->bitmap);
+	font = open_font(context, font_name->match, key.mode);
 
-			glyph->advance = font->face->glyph->metrics.horiAdvance >> 6;
-			glyph->x = font->face->glyph->bitmap_left;
-			glyph->y = -font->face->glyph->bitmap_top;
+	if (!font) {
+		font_name_release(context, font_name);
+		return NULL;
+	}
 
-			font->glyphs[glyph_index] = glyph;
-		}
+	/* The font now holds the reference to the name. */
+	font->font_name = font_name;
+	num_fallbacks = MIN(font_name->set->nfont, FONT_MAX_FALLBACKS);
 
-		return true;
+	if (!(fallbacks = calloc(num_fallbacks, sizeof fallbacks[0]))) {
+		wld_font_close(&font->base);
+		return NULL;
 	}
 
-	return false;
+	font->fallbacks = fallbacks;
+	font->num_fallbacks = num_fallbacks;
+
+	font->pattern = font_name->pattern;
+	font->fallback_set = font_name->set;
+
+	return &register_font(font)->base;
+}
+
+EXPORT
+struct wld_font *
+wld_font_open_name(struct wld_font_context *context, const char *name)
+{
+	return open_name(context, name, NULL);
+}
+
+EXPORT
+struct wld_font *
+wld_font_open_name_sdf(struct wld_font_context *context, const char *name)
+{
+#if HAVE_FT_SDF
+	static const enum font_render_mode mode = FONT_RENDER_SDF;
+
+	return open_name(context, name, &mode);
+#else
+	DEBUG("FreeType is too old to render distance fields\n");
+
+	return NULL;
+#endif
+}
+
+struct open_request {
+	struct wld_font_context *context;
+	char *name;
+	void (*callback)(struct wld_font *font, void *data);
+	void *data;
+};
+
+static void *
+open_name_thread(void *data)
+{
+	struct open_request *request = data;
+	struct wld_font_context *context = request->context;
+	void (*callback)(struct wld_font *font, void *data) = request->callback;
+	struct wld_font *font;
+
+	font = wld_font_open_name(context, request->name);
+	data = request->data;
+	free(request->name);
+	free(request);
+
+	/* The context is no longer used once the font is open, so the
+	 * callback may destroy it (after closing the font). */
+	pthread_mutex_lock(&context->lock);
+
+	if (--context->pending == 0)
+		pthread_cond_broadcast(&context->idle);
+
+	pthread_mutex_unlock(&context->lock);
+	callback(font, data);
+
+	return NULL;
 }
 
 EXPORT
 bool
-wld_font_ensure_char(struct wld_font *font_base, uint32_t character)
+wld_font_open_name_async(struct wld_font_context *context, const char *name,
+                         void (*callback)(struct wld_font *font, void *data),
+                         void *data)
 {
-	struct font *font = (void *)font_base;
-	FT_UInt glyph_index;
+	struct open_request *request;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int error;
 
-	glyph_index = FT_Get_Char_Index(font->face, character);
+	if (!(request = malloc(sizeof *request)))
+		goto error0;
+
+	if (!(request->name = strdup(name)))
+		goto error1;
+
+	request->context = context;
+	request->callback = callback;
+	request->data = data;
+
+	if (pthread_attr_init(&attr) != 0)
+		goto error2;
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&context->lock);
+	error = pthread_create(&thread, &attr, &open_name_thread, request);
+
+	if (error == 0)
+		++context->pending;
+
+	pthread_mutex_unlock(&context->lock);
+	pthread_attr_destroy(&attr);
+
+	if (error != 0)
+		goto error2;
+
+	return true;
+
+error2:
+	free(request->name);
+error1:
+	free(request);
+error0:
+	return false;
+}
+
+/**
+ * Wait for the font's prepare thread to exit, optionally asking it to stop
+ * early.
+ */
+static void
+finish_prepare(struct font *font, bool cancel)
+{
+	if (!font->prepare.running)
+		return;
+
+	if (cancel)
+		__atomic_store_n(&font->prepare.cancel, true, __ATOMIC_RELAXED);
+
+	pthread_join(font->prepare.thread, NULL);
+	free(font->prepare.ranges);
+	font->prepare.running = false;
+}
 
-	return font_ensure_glyph(font, glyph_index);
+void
+font_reference(struct font *font)
+{
+	pthread_mutex_lock(&font->context->lock);
+	++font->ref;
+	pthread_mutex_unlock(&font->context->lock);
 }
 
 EXPORT
 void
-wld_font_text_extents_n(struct wld_font *font_base,
-                        const char *text, int32_t length,
-                        struct wld_extents *extents)
+wld_font_close(struct wld_font *font_base)
 {
 	struct font *font = (void *)font_base;
-	int ret;
-	uint32_t c;
-	FT_UInt glyph_index;
+	struct glyph_atlas_page *page, *next;
+	struct char_cache_table *table, *previous;
+	struct font **link;
+	struct glyph *glyph;
+	uint32_t index, glyph_index;
+
+	pthread_mutex_lock(&font->context->lock);
+
+	if (--font->ref > 0) {
+		pthread_mutex_unlock(&font->context->lock);
+		return;
+	}
+
+	if (font->registered) {
+		for (link = &font->context->fonts; *link != font;
+		     link = &(*link)->next) {
+		}
+
+		*link = font->next;
+	}
+
+	pthread_mutex_unlock(&font->context->lock);
+
+	finish_prepare(font, true);
+	text_run_cache_remove_font(&font->context->run_cache, font);
 
-	extents->advance = 0;
+	for (index = 0; index < font->num_fallbacks; ++index) {
+		if (font->fallbacks[index])
+			wld_font_close(&font->fallbacks[index]->base);
+	}
+
+	if (font->mono)
+		wld_font_close(&font->mono->base);
 
-	while ((ret = FcUtf8ToUcs4((FcChar8 *)text, &c, length) > 0) && c != '\0') {
-		length -= ret;
-		text += ret;
-		glyph_index = FT_Get_Char_Index(font->face, c);
+	if (font->font_name)
+		font_name_release(font->context, font->font_name);
 
-		if (!font_ensure_glyph(font, glyph_index))
+	font_cache_close(font);
+
+	for (index = 0; index < font->num_glyph_pages; ++index) {
+		if (!(glyph = font->glyph_pages[index]))
 			continue;
 
-		extents->advance += font->glyphs[glyph_index]->advance;
+		for (glyph_index = 0; glyph_index < GLYPH_PAGE_SIZE; ++glyph_index)
+			free(glyph[glyph_index].compressed);
+
+		free(glyph);
+	}
+
+	for (page = font->atlas.pages; page; page = next) {
+		next = page->next;
+		free(page);
+	}
+
+	free(font->fallbacks);
+	free(font->glyph_pages);
+	for (table = font->char_cache.table; table; table = previous) {
+		previous = table->previous;
+		free(table);
 	}
+
+	free(font->char_cache.direct);
+	FT_Bitmap_Done(font->context->library, &font->convert_bitmap);
+	pthread_mutex_lock(&font->font_face->lock);
+	FT_Done_Size(font->size);
+	pthread_mutex_unlock(&font->font_face->lock);
+	release_face(font->context, font->font_face);
+	FcPatternDestroy(font->match);
+	pthread_mutex_destroy(&font->lock);
+	pthread_rwlock_destroy(&font->draw_lock);
+	pthread_mutex_destroy(&font->prepare.lock);
+	free(font);
+}
+
+static inline uint32_t
+char_hash(uint32_t character)
+{
+	/* Knuth's multiplicative hash. */
+	return character * 2654435761u;
+}
+
+static struct char_cache_entry *
+char_cache_find(struct char_cache_table *table, uint32_t character)
+{
+	uint32_t index = char_hash(character) & (table->size - 1);
+
+	while (table->entries[index].character != character
+	       && table->entries[index].value != 0) {
+		index = (index + 1) & (table->size - 1);
+	}
+
+	return &table->entries[index];
+}
+
+static bool
+char_cache_grow(struct char_cache *cache)
+{
+	struct char_cache_table *old = cache->table, *table;
+	struct char_cache_entry *entry;
+	uint32_t index;
+
+	table = calloc(1, sizeof *table + (old ? old->size * 2 : 64)
+	                                  * sizeof table->entries[0]);
+
+	if (!table)
+		return false;
+
+	table->previous = old;
+	table->size = old ? old->size * 2 : 64;
+
+	for (index = 0; old && index < old->size; ++index) {
+		if (old->entries[index].value == 0)
+			continue;
+
+		entry = char_cache_find(table, old->entries[index].character);
+		*entry = old->entries[index];
+	}
+
+	__atomic_store_n(&cache->table, table, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+ * Look up a character without the font lock.
+ */
+static uint32_t
+char_cache_get(struct char_cache *cache, uint32_t character)
+{
+	struct char_cache_table *table;
+	struct char_cache_entry *entry;
+	uint32_t *direct, index, value;
+
+	if (character < CHAR_CACHE_DIRECT_SIZE) {
+		direct = __atomic_load_n(&cache->direct, __ATOMIC_ACQUIRE);
+
+		if (!direct)
+			return 0;
+
+		return __atomic_load_n(&direct[character], __ATOMIC_ACQUIRE);
+	}
+
+	if (!(table = __atomic_load_n(&cache->table, __ATOMIC_ACQUIRE)))
+		return 0;
+
+	index = char_hash(character) & (table->size - 1);
+
+	/* An entry's character is stored before its value, so it is valid once
+	 * the value is seen to be non-zero. */
+	for (;;) {
+		entry = &table->entries[index];
+		value = __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE);
+
+		if (value == 0)
+			return 0;
+
+		if (__atomic_load_n(&entry->character, __ATOMIC_RELAXED) == character)
+			return value;
+
+		index = (index + 1) & (table->size - 1);
+	}
+}
+
+/**
+ * Add a character to the cache. The font lock must be held.
+ */
+static void
+char_cache_set(struct char_cache *cache, uint32_t character, uint32_t value)
+{
+	struct char_cache_entry *entry;
+	uint32_t *direct;
+
+	if (character < CHAR_CACHE_DIRECT_SIZE) {
+		if (!(direct = cache->direct)) {
+			direct = calloc(CHAR_CACHE_DIRECT_SIZE, sizeof direct[0]);
+
+			if (!direct)
+				return;
+
+			__atomic_store_n(&cache->direct, direct, __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&direct[character], value, __ATOMIC_RELEASE);
+
+		return;
+	}
+
+	/* Arbitrary text can contain any number of characters missing from
+	 * every font, and the table is never shrunk, so only characters which
+	 * were found are added to it. */
+	if (value == 1)
+		return;
+
+	/* Keep the load factor below 3/4. */
+	if ((!cache->table || (cache->count + 1) * 4 > cache->table->size * 3)
+	    && !char_cache_grow(cache)) {
+		return;
+	}
+
+	entry = char_cache_find(cache->table, character);
+	__atomic_store_n(&entry->character, character, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->value, value, __ATOMIC_RELEASE);
+	++cache->count;
+}
+
+static struct font *
+open_fallback(struct font *font, uint32_t slot)
+{
+	FcPattern *match;
+	struct font *fallback;
+
+	if (font->fallbacks[slot])
+		return font->fallbacks[slot];
+
+	match = FcFontRenderPrepare(NULL, font->pattern,
+	                            font->fallback_set->fonts[slot]);
+
+	if (!match)
+		return NULL;
+
+	/* Glyphs from fallbacks are drawn as if they came from this font, so
+	 * they must be rendered the same way. */
+	fallback = open_font(font->context, match, font->mode);
+	FcPatternDestroy(match);
+
+	if (!fallback)
+		return NULL;
+
+	fallback->parent = font;
+	fallback->atlas.max_size = font->atlas.max_size;
+	font->fallbacks[slot] = fallback;
+
+	return fallback;
+}
+
+static FT_UInt
+char_index(struct font *font, uint32_t character)
+{
+	FT_UInt glyph_index;
+
+	pthread_mutex_lock(&font->font_face->lock);
+	glyph_index = FT_Get_Char_Index(font->face, character);
+	pthread_mutex_unlock(&font->font_face->lock);
+
+	return glyph_index;
+}
+
+/**
+ * Find the font containing the given character, returning a value in the
+ * format used by the character cache.
+ */
+static uint32_t
+find_char(struct font *font, uint32_t character)
+{
+	struct font *fallback;
+	FcCharSet *charset;
+	FT_UInt glyph_index;
+	uint32_t slot;
+
+	glyph_index = char_index(font, character);
+
+	if (glyph_index != 0 || !font->fallback_set)
+		return glyph_index;
+
+	for (slot = 0; slot < font->num_fallbacks; ++slot) {
+		if (FcPatternGetCharSet(font->fallback_set->fonts[slot],
+		                        FC_CHARSET, 0, &charset) != FcResultMatch
+		    || !FcCharSetHasChar(charset, character)) {
+			continue;
+		}
+
+		if (!(fallback = open_fallback(font, slot)))
+			continue;
+
+		glyph_index = char_index(fallback, character);
+
+		if (glyph_index != 0)
+			return (slot + 1) << CHAR_SLOT_SHIFT | glyph_index;
+	}
+
+	return 0;
+}
+
+struct glyph *
+font_char_glyph(struct font *font, uint32_t character,
+                struct font **glyph_font)
+{
+	uint32_t value, slot;
+
+	if ((value = char_cache_get(&font->char_cache, character)) == 0) {
+		pthread_mutex_lock(&font->lock);
+
+		/* Another thread may have looked it up while we were waiting. */
+		if ((value = char_cache_get(&font->char_cache, character)) == 0) {
+			value = find_char(font, character) + 1;
+			char_cache_set(&font->char_cache, character, value);
+		}
+
+		pthread_mutex_unlock(&font->lock);
+	}
+
+	--value;
+	slot = value >> CHAR_SLOT_SHIFT;
+
+	/* The fallback was opened before the value was published. */
+	if (slot > 0)
+		font = font->fallbacks[slot - 1];
+
+	if (glyph_font)
+		*glyph_font = font;
+
+	return font_ensure_glyph(font, value & ((1 << CHAR_SLOT_SHIFT) - 1));
+}
+
+static void *
+atlas_alloc(struct glyph_atlas *atlas, size_t size)
+{
+	struct glyph_atlas_page *page = atlas->pages;
+	void *data;
+
+	/* Keep bitmaps 4-byte aligned so they can be used as pixman images. */
+	size = (size + 3) & ~3;
+
+	if (!page || page->size - page->used < size) {
+		size_t page_size = GLYPH_ATLAS_PAGE_SIZE;
+
+		/* Large bitmaps get a page of their own so that they don't waste
+		 * the rest of the current page. */
+		if (size > GLYPH_ATLAS_PAGE_SIZE / 4)
+			page_size = size;
+
+		if (!(page = malloc(sizeof *page + page_size)))
+			return NULL;
+
+		page->size = page_size;
+		page->used = 0;
+		atlas->size += sizeof *page + page_size;
+
+		if (page_size == size && atlas->pages) {
+			page->next = atlas->pages->next;
+			atlas->pages->next = page;
+		} else {
+			page->next = atlas->pages;
+			atlas->pages = page;
+		}
+	}
+
+	data = page->data + page->used;
+	page->used += size;
+
+	return data;
+}
+
+static bool
+store_bitmap(struct font *font, struct glyph *glyph, FT_Bitmap *bitmap)
+{
+	FT_Bitmap *converted = &font->convert_bitmap;
+	FT_Pixel_Mode pixel_mode;
+	uint8_t *src, *dst, *end;
+	uint32_t row;
+
+	glyph->width = bitmap->width;
+	glyph->height = bitmap->rows;
+	glyph->pitch = glyph_pitch(font->mode, bitmap->width);
+	pixel_mode = font->mode == FONT_RENDER_MONO ? FT_PIXEL_MODE_MONO
+	                                            : FT_PIXEL_MODE_GRAY;
+
+	if (glyph->width == 0 || glyph->height == 0) {
+		glyph->bitmap = NULL;
+		return true;
+	}
+
+	/* Bitmaps which are not already in the format of the render mode, such
+	 * as embedded strikes, are converted to 8-bit coverage first. */
+	if (bitmap->pixel_mode != pixel_mode) {
+		if (FT_Bitmap_Convert(font->context->library,
+		                      bitmap, converted, 1) != 0) {
+			return false;
+		}
+
+		if (converted->num_grays != 256 && converted->num_grays > 1) {
+			end = converted->buffer + converted->pitch * converted->rows;
+
+			for (dst = converted->buffer; dst < end; ++dst)
+				*dst = *dst * 255 / (converted->num_grays - 1);
+		}
+
+		bitmap = converted;
+	}
+
+	if (!(glyph->bitmap = atlas_alloc(&font->atlas,
+	                                  glyph->pitch * glyph->height))) {
+		return false;
+	}
+
+	src = bitmap->buffer;
+	dst = glyph->bitmap;
+
+	for (row = 0; row < glyph->height; ++row) {
+		if (pixel_mode == FT_PIXEL_MODE_GRAY)
+			memcpy(dst, src, glyph->width);
+		else if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO)
+			memcpy(dst, src, glyph->pitch);
+		else
+			glyph_pack_mono_row(dst, src, glyph->width);
+
+		src += bitmap->pitch;
+		dst += glyph->pitch;
+	}
+
+	return true;
+}
+
+/**
+ * Returns the number of bytes of each row of a glyph's bitmap that hold
+ * pixels, leaving out the padding of 8-bit bitmaps.
+ */
+static inline uint32_t
+row_length(struct font *font, struct glyph *glyph)
+{
+	return font->mode == FONT_RENDER_MONO ? glyph->pitch : glyph->width;
+}
+
+static uint32_t
+pack_row(uint8_t *dst, const uint8_t *src, uint32_t length)
+{
+	uint8_t *start = dst;
+	uint32_t index = 0, count;
+
+	while (index < length) {
+		for (count = 1; index + count < length && count < 128
+		                && src[index + count] == src[index];
+		     ++count) {
+		}
+
+		/* Runs of three or more bytes are stored as one byte. */
+		if (count >= 3) {
+			*dst++ = 257 - count;
+			*dst++ = src[index];
+			index += count;
+			continue;
+		}
+
+		/* Otherwise, store bytes literally up to the next run. */
+		for (count = 1; index + count < length && count < 128; ++count) {
+			if (index + count + 2 < length
+			    && src[index + count] == src[index + count + 1]
+			    && src[index + count] == src[index + count + 2]) {
+				break;
+			}
+		}
+
+		*dst++ = count - 1;
+		memcpy(dst, &src[index], count);
+		dst += count;
+		index += count;
+	}
+
+	return dst - start;
+}
+
+static const uint8_t *
+unpack_row(uint8_t *dst, const uint8_t *src, uint32_t length)
+{
+	uint32_t count;
+
+	while (length > 0) {
+		if (*src < 128) {
+			count = *src++ + 1;
+			memcpy(dst, src, count);
+			src += count;
+		} else {
+			count = 257 - *src++;
+			memset(dst, *src++, count);
+		}
+
+		dst += count;
+		length -= count;
+	}
+
+	return src;
+}
+
+/**
+ * Compress a glyph's bitmap before its atlas page is freed, if it is worth
+ * it. The font lock must be held.
+ */
+static void
+compress_bitmap(struct font *font, struct glyph *glyph)
+{
+	uint32_t length = row_length(font, glyph), row, size = 0;
+	uint8_t *compressed, *resized;
+
+	/* Each run of up to 128 literal bytes needs a header byte. */
+	compressed = malloc(glyph->height * (length + (length + 127) / 128));
+
+	if (!compressed)
+		return;
+
+	for (row = 0; row < glyph->height; ++row) {
+		size += pack_row(compressed + size,
+		                 glyph->bitmap + row * glyph->pitch, length);
+	}
+
+	if (size >= glyph->pitch * glyph->height) {
+		free(compressed);
+		return;
+	}
+
+	if ((resized = realloc(compressed, size)))
+		compressed = resized;
+
+	glyph->compressed = compressed;
+	glyph->compressed_size = size;
+	font->atlas.size += size;
+}
+
+/**
+ * Load a glyph's bitmap from its compressed copy. The font lock must be held.
+ */
+static bool
+decompress_bitmap(struct font *font, struct glyph *glyph)
+{
+	uint32_t length = row_length(font, glyph), row;
+	const uint8_t *src = glyph->compressed;
+	uint8_t *dst;
+
+	if (!(glyph->bitmap = atlas_alloc(&font->atlas,
+	                                  glyph->pitch * glyph->height))) {
+		return false;
+	}
+
+	for (row = 0, dst = glyph->bitmap; row < glyph->height;
+	     ++row, dst += glyph->pitch) {
+		src = unpack_row(dst, src, length);
+		memset(dst + length, 0, glyph->pitch - length);
+	}
+
+	font->atlas.size -= glyph->compressed_size;
+	free(glyph->compressed);
+	glyph->compressed = NULL;
+
+	return true;
+}
+
+/**
+ * Load a glyph into the face's glyph slot at the font's size. The face lock
+ * must be held while the slot is in use.
+ */
+static FT_GlyphSlot
+load_glyph(struct font *font, FT_UInt glyph_index, FT_Int32 load_flags)
+{
+	if (FT_Activate_Size(font->size) != 0
+	    || FT_Load_Glyph(font->face, glyph_index, load_flags) != 0) {
+		return NULL;
+	}
+
+	return font->face->glyph;
+}
+
+/**
+ * Load a glyph's metrics into the glyph table. The font lock must be held.
+ */
+static struct glyph *
+load_metrics(struct font *font, FT_UInt glyph_index)
+{
+	struct glyph *page, *glyph;
+	FT_GlyphSlot slot;
+
+	page = font->glyph_pages[glyph_index >> GLYPH_PAGE_SHIFT];
+
+	if (!page) {
+		if (!(page = calloc(GLYPH_PAGE_SIZE, sizeof page[0])))
+			return NULL;
+
+		__atomic_store_n(&font->glyph_pages[glyph_index >> GLYPH_PAGE_SHIFT],
+		                 page, __ATOMIC_RELEASE);
+	}
+
+	glyph = &page[glyph_index & (GLYPH_PAGE_SIZE - 1)];
+
+	if (glyph->metrics_loaded)
+		return glyph;
+
+	glyph->index = glyph_index;
+
+	/* Cached glyphs come with their bitmap, so load both at once. */
+	if (font_cache_load_glyph(font, glyph_index, glyph)) {
+		__atomic_store_n(&glyph->bitmap_loaded, true, __ATOMIC_RELEASE);
+		__atomic_store_n(&glyph->metrics_loaded, true, __ATOMIC_RELEASE);
+		return glyph;
+	}
+
+	pthread_mutex_lock(&font->font_face->lock);
+
+	/* Load the glyph with the same flags it will be rendered with, so that
+	 * the hinted advance matches, but don't render it. */
+	if (!(slot = load_glyph(font, glyph_index,
+	                        font->load_flags & ~FT_LOAD_RENDER))) {
+		pthread_mutex_unlock(&font->font_face->lock);
+		return NULL;
+	}
+
+	/* Hinted advances are whole pixels, but unhinted ones are rounded. */
+	glyph->advance = (slot->metrics.horiAdvance + 32) >> 6;
+	pthread_mutex_unlock(&font->font_face->lock);
+	__atomic_store_n(&glyph->metrics_loaded, true, __ATOMIC_RELEASE);
+
+	return glyph;
+}
+
+/**
+ * Rasterize a glyph whose metrics are loaded. The font lock must be held.
+ */
+static bool
+load_bitmap(struct font *font, struct glyph *glyph)
+{
+	FT_GlyphSlot slot;
+
+	if (glyph->bitmap_loaded)
+		return true;
+
+	if (glyph->compressed) {
+		if (!decompress_bitmap(font, glyph))
+			return false;
+
+		goto done;
+	}
+
+	pthread_mutex_lock(&font->font_face->lock);
+
+	if (!(slot = load_glyph(font, glyph->index, font->load_flags))
+#if HAVE_FT_SDF
+	    || (font->mode == FONT_RENDER_SDF
+	        && FT_Render_Glyph(slot, FT_RENDER_MODE_SDF) != 0)
+#endif
+	    || !store_bitmap(font, glyph, &slot->bitmap)) {
+		pthread_mutex_unlock(&font->font_face->lock);
+		return false;
+	}
+
+	glyph->x = slot->bitmap_left;
+	glyph->y = -slot->bitmap_top;
+	pthread_mutex_unlock(&font->font_face->lock);
+	font->cache.dirty = true;
+
+done:
+	__atomic_store_n(&glyph->bitmap_loaded, true, __ATOMIC_RELEASE);
+
+	if (font->atlas.size > font->atlas.max_size)
+		__atomic_store_n(&font_root(font)->over_budget, true, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+struct glyph *
+font_ensure_glyph(struct font *font, FT_UInt glyph_index)
+{
+	struct glyph *page, *glyph;
+
+	if (glyph_index == 0 || glyph_index >= font->face->num_glyphs)
+		return NULL;
+
+	page = __atomic_load_n(&font->glyph_pages[glyph_index >> GLYPH_PAGE_SHIFT],
+	                       __ATOMIC_ACQUIRE);
+
+	if (page) {
+		glyph = &page[glyph_index & (GLYPH_PAGE_SIZE - 1)];
+
+		if (__atomic_load_n(&glyph->metrics_loaded, __ATOMIC_ACQUIRE))
+			return glyph;
+	}
+
+	pthread_mutex_lock(&font->lock);
+	glyph = load_metrics(font, glyph_index);
+	pthread_mutex_unlock(&font->lock);
+
+	return glyph;
+}
+
+bool
+font_ensure_bitmap(struct font *font, struct glyph *glyph)
+{
+	uint32_t clock;
+	bool success;
+
+	clock = __atomic_load_n(&font_root(font)->clock, __ATOMIC_RELAXED);
+
+	/* Avoid writing to the glyph if it has already been used in this
+	 * draw. */
+	if (__atomic_load_n(&glyph->last_used, __ATOMIC_RELAXED) != clock)
+		__atomic_store_n(&glyph->last_used, clock, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&glyph->bitmap_loaded, __ATOMIC_ACQUIRE))
+		return true;
+
+	pthread_mutex_lock(&font->lock);
+	success = load_bitmap(font, glyph);
+	pthread_mutex_unlock(&font->lock);
+
+	return success;
+}
+
+struct atlas_page_age {
+	struct glyph_atlas_page *page;
+	uint32_t age;
+	bool evict;
+};
+
+static int
+compare_page_address(const void *a, const void *b)
+{
+	uintptr_t page_a = (uintptr_t)((const struct atlas_page_age *)a)->page,
+	          page_b = (uintptr_t)((const struct atlas_page_age *)b)->page;
+
+	return page_a < page_b ? -1 : page_a > page_b;
+}
+
+static int
+compare_page_age(const void *a, const void *b)
+{
+	uint32_t age_a = ((const struct atlas_page_age *)a)->age,
+	         age_b = ((const struct atlas_page_age *)b)->age;
+
+	return age_a > age_b ? -1 : age_a < age_b;
+}
+
+/**
+ * Find the atlas page containing a bitmap, given the pages sorted by address.
+ * Bitmaps from the glyph cache file are not in any page.
+ */
+static struct atlas_page_age *
+find_page(struct atlas_page_age *pages, uint32_t num_pages,
+          const uint8_t *bitmap)
+{
+	uint32_t low = 0, high = num_pages, middle;
+	struct glyph_atlas_page *page;
+
+	while (low < high) {
+		middle = (low + high) / 2;
+		page = pages[middle].page;
+
+		if ((uintptr_t)bitmap < (uintptr_t)page->data)
+			high = middle;
+		else if ((uintptr_t)bitmap >= (uintptr_t)(page->data + page->size))
+			low = middle + 1;
+		else
+			return &pages[middle];
+	}
+
+	return NULL;
+}
+
+struct glyph_age {
+	struct glyph *glyph;
+	uint32_t age;
+};
+
+static int
+compare_glyph_age(const void *a, const void *b)
+{
+	uint32_t age_a = ((const struct glyph_age *)a)->age,
+	         age_b = ((const struct glyph_age *)b)->age;
+
+	return age_a > age_b ? -1 : age_a < age_b;
+}
+
+/**
+ * Free the compressed bitmaps of the least recently used glyphs until the
+ * atlas is at most the given size. The font lock must be held.
+ */
+static void
+drop_compressed(struct font *font, uint32_t clock, size_t target_size)
+{
+	struct glyph_age *glyphs;
+	struct glyph *glyph;
+	uint32_t index, glyph_index, count = 0;
+
+	for (index = 0; index < font->num_glyph_pages; ++index) {
+		if (!(glyph = font->glyph_pages[index]))
+			continue;
+
+		for (glyph_index = 0; glyph_index < GLYPH_PAGE_SIZE; ++glyph_index)
+			count += glyph[glyph_index].compressed != NULL;
+	}
+
+	if (!(glyphs = malloc(count * sizeof glyphs[0])))
+		return;
+
+	for (index = 0, count = 0; index < font->num_glyph_pages; ++index) {
+		if (!(glyph = font->glyph_pages[index]))
+			continue;
+
+		for (glyph_index = 0; glyph_index < GLYPH_PAGE_SIZE; ++glyph_index) {
+			if (!glyph[glyph_index].compressed)
+				continue;
+
+			glyphs[count].glyph = &glyph[glyph_index];
+			glyphs[count++].age = clock - glyph[glyph_index].last_used;
+		}
+	}
+
+	qsort(glyphs, count, sizeof glyphs[0], &compare_glyph_age);
+
+	for (index = 0; index < count && font->atlas.size > target_size; ++index) {
+		glyph = glyphs[index].glyph;
+		font->atlas.size -= glyph->compressed_size;
+		free(glyph->compressed);
+		glyph->compressed = NULL;
+	}
+
+	free(glyphs);
+}
+
+/**
+ * Free the least recently used atlas pages until the atlas is at most 3/4 of
+ * its maximum size, unloading the glyphs in them. Their bitmaps are kept
+ * compressed, which count towards the size of the atlas, and are dropped
+ * too, starting with the least recently used, if that is still too much.
+ * This must only be called with the draw lock held for writing, so the
+ * bitmaps are not in use.
+ */
+static void
+evict_bitmaps(struct font *font, uint32_t clock)
+{
+	struct glyph_atlas *atlas = &font->atlas;
+	struct glyph_atlas_page *page, **link;
+	struct atlas_page_age *pages, *page_age;
+	struct glyph *glyph;
+	uint32_t num_pages = 0, index, glyph_index;
+	size_t target_size = atlas->max_size / 4 * 3;
+
+	pthread_mutex_lock(&font->lock);
+
+	if (atlas->size <= atlas->max_size)
+		goto done;
+
+	for (page = atlas->pages; page; page = page->next)
+		++num_pages;
+
+	if (!(pages = malloc(num_pages * sizeof pages[0])))
+		goto done;
+
+	for (page = atlas->pages, index = 0; page; page = page->next, ++index) {
+		pages[index].page = page;
+		pages[index].age = UINT32_MAX;
+		pages[index].evict = false;
+	}
+
+	qsort(pages, num_pages, sizeof pages[0], &compare_page_address);
+
+	/* A page is as old as the most recently used glyph in it. */
+	for (index = 0; index < font->num_glyph_pages; ++index) {
+		if (!(glyph = font->glyph_pages[index]))
+			continue;
+
+		for (glyph_index = 0; glyph_index < GLYPH_PAGE_SIZE; ++glyph_index) {
+			if (!glyph[glyph_index].bitmap_loaded
+			    || !glyph[glyph_index].bitmap
+			    || !(page_age = find_page(pages, num_pages,
+			                              glyph[glyph_index].bitmap))) {
+				continue;
+			}
+
+			page_age->age = MIN(page_age->age,
+			                    clock - glyph[glyph_index].last_used);
+		}
+	}
+
+	qsort(pages, num_pages, sizeof pages[0], &compare_page_age);
+
+	for (index = 0; index < num_pages && atlas->size > target_size; ++index) {
+		pages[index].evict = true;
+		atlas->size -= sizeof *pages[index].page + pages[index].page->size;
+	}
+
+	qsort(pages, num_pages, sizeof pages[0], &compare_page_address);
+
+	for (index = 0; index < font->num_glyph_pages; ++index) {
+		if (!(glyph = font->glyph_pages[index]))
+			continue;
+
+		for (glyph_index = 0; glyph_index < GLYPH_PAGE_SIZE; ++glyph_index) {
+			if (!glyph[glyph_index].bitmap_loaded
+			    || !glyph[glyph_index].bitmap
+			    || !(page_age = find_page(pages, num_pages,
+			                              glyph[glyph_index].bitmap))
+			    || !page_age->evict) {
+				continue;
+			}
+
+			compress_bitmap(font, &glyph[glyph_index]);
+			glyph[glyph_index].bitmap = NULL;
+			__atomic_store_n(&glyph[glyph_index].bitmap_loaded, false,
+			                 __ATOMIC_RELAXED);
+		}
+	}
+
+	for (link = &atlas->pages; (page = *link);) {
+		page_age = find_page(pages, num_pages, page->data);
+
+		if (page_age->evict) {
+			*link = page->next;
+			free(page);
+		} else
+			link = &page->next;
+	}
+
+	free(pages);
+
+	if (atlas->size > target_size)
+		drop_compressed(font, clock, target_size);
+
+done:
+	pthread_mutex_unlock(&font->lock);
+}
+
+struct font *
+font_monochrome(struct font *font)
+{
+	static const enum font_render_mode mode = FONT_RENDER_MONO;
+	struct font *mono;
+
+	/* Fonts opened from an FC_FT_FACE pattern would need a second font
+	 * using the same face, which can't be locked separately. */
+	if (font->mode != FONT_RENDER_GRAY || !font->font_face->filename)
+		return font;
+
+	if ((mono = __atomic_load_n(&font->mono, __ATOMIC_ACQUIRE)))
+		return mono;
+
+	pthread_mutex_lock(&font->lock);
+
+	if (!(mono = font->mono)) {
+		mono = (void *)(font->font_name
+		                    ? open_name(font->context, font->font_name->name,
+		                                &mode)
+		                    : open_pattern(font->context, font->match, mode));
+
+		if (mono) {
+			if (font->atlas.max_size != SIZE_MAX) {
+				wld_font_set_glyph_cache_size(&mono->base,
+				                              font->atlas.max_size);
+			}
+
+			__atomic_store_n(&font->mono, mono, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&font->lock);
+
+	return mono ? mono : font;
+}
+
+void
+font_begin_draw(struct font *font)
+{
+	pthread_rwlock_rdlock(&font->draw_lock);
+	__atomic_add_fetch(&font->clock, 1, __ATOMIC_RELAXED);
+}
+
+void
+font_end_draw(struct font *font)
+{
+	uint32_t index, clock;
+
+	pthread_rwlock_unlock(&font->draw_lock);
+
+	if (!__atomic_load_n(&font->over_budget, __ATOMIC_RELAXED))
+		return;
+
+	/* If other draws are in progress, the last of them evicts the
+	 * bitmaps instead. */
+	if (pthread_rwlock_trywrlock(&font->draw_lock) != 0)
+		return;
+
+	__atomic_store_n(&font->over_budget, false, __ATOMIC_RELAXED);
+	clock = __atomic_load_n(&font->clock, __ATOMIC_RELAXED);
+	evict_bitmaps(font, clock);
+
+	pthread_mutex_lock(&font->lock);
+
+	for (index = 0; index < font->num_fallbacks; ++index) {
+		if (font->fallbacks[index])
+			evict_bitmaps(font->fallbacks[index], clock);
+	}
+
+	pthread_mutex_unlock(&font->lock);
+	pthread_rwlock_unlock(&font->draw_lock);
+}
+
+EXPORT
+void
+wld_font_set_glyph_cache_size(struct wld_font *font_base, size_t size)
+{
+	struct font *font = (void *)font_base;
+	uint32_t index;
+
+	pthread_mutex_lock(&font->lock);
+	font->atlas.max_size = size;
+
+	for (index = 0; index < font->num_fallbacks; ++index) {
+		if (!font->fallbacks[index])
+			continue;
+
+		pthread_mutex_lock(&font->fallbacks[index]->lock);
+		font->fallbacks[index]->atlas.max_size = size;
+		pthread_mutex_unlock(&font->fallbacks[index]->lock);
+	}
+
+	if (font->mono)
+		wld_font_set_glyph_cache_size(&font->mono->base, size);
+
+	pthread_mutex_unlock(&font->lock);
+
+	/* Evict any glyphs over the new size at the end of the next draw. */
+	__atomic_store_n(&font->over_budget, true, __ATOMIC_RELAXED);
+}
+
+EXPORT
+bool
+wld_font_ensure_char(struct wld_font *font_base, uint32_t character)
+{
+	struct font *font = (void *)font_base;
+	struct glyph *glyph;
+
+	if (!(glyph = font_char_glyph(font, character, &font)))
+		return false;
+
+	return font_ensure_bitmap(font, glyph);
+}
+
+static void *
+prepare_glyphs(void *data)
+{
+	struct font *font = data;
+	const struct wld_font_range *range, *end;
+	struct font *glyph_font;
+	struct glyph *glyph;
+	uint32_t character;
+
+	end = font->prepare.ranges + font->prepare.num_ranges;
+
+	for (range = font->prepare.ranges; range < end; ++range) {
+		for (character = range->first; character <= range->last; ++character) {
+			if (__atomic_load_n(&font->prepare.cancel, __ATOMIC_RELAXED))
+				return NULL;
+
+			if ((glyph = font_char_glyph(font, character, &glyph_font)))
+				font_ensure_bitmap(glyph_font, glyph);
+		}
+	}
+
+	return NULL;
+}
+
+EXPORT
+bool
+wld_font_prepare(struct wld_font *font_base,
+                 const struct wld_font_range *ranges, uint32_t num_ranges)
+{
+	struct font *font = (void *)font_base;
+	uint32_t index;
+
+	pthread_mutex_lock(&font->prepare.lock);
+	finish_prepare(font, false);
+
+	if (num_ranges == 0)
+		goto done;
+
+	font->prepare.ranges = malloc(num_ranges * sizeof ranges[0]);
+
+	if (!font->prepare.ranges)
+		goto error0;
+
+	for (index = 0; index < num_ranges; ++index) {
+		font->prepare.ranges[index].first = ranges[index].first;
+		/* Characters stop at U+10FFFF, which also keeps the loop in
+		 * prepare_glyphs from overflowing. */
+		font->prepare.ranges[index].last = MIN(ranges[index].last, 0x10ffff);
+	}
+
+	font->prepare.num_ranges = num_ranges;
+	font->prepare.cancel = false;
+
+	if (pthread_create(&font->prepare.thread, NULL,
+	                   &prepare_glyphs, font) != 0) {
+		goto error1;
+	}
+
+	font->prepare.running = true;
+
+done:
+	pthread_mutex_unlock(&font->prepare.lock);
+
+	return true;
+
+error1:
+	free(font->prepare.ranges);
+error0:
+	pthread_mutex_unlock(&font->prepare.lock);
+
+	return false;
+}
+
+EXPORT
+void
+wld_font_text_extents_n(struct wld_font *font_base,
+                        const char *text, int32_t length,
+                        struct wld_extents *extents)
+{
+	struct font *font = (void *)font_base;
+	struct text_run *run;
+
+	if (!(run = font_text_run(font, text, length))) {
+		extents->advance = 0;
+		return;
+	}
+
+	extents->advance = run->advance;
+	text_run_release(run);
 }
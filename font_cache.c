@@ -0,0 +1,390 @@
+/* wld: font_cache.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FONT_CACHE_MAGIC "wldglyph"
+#define FONT_CACHE_VERSION 1
+
+/* A cache file consists of a header, the path of the font file padded to a
+ * multiple of 4 bytes, the glyph entries sorted by glyph index, and then the
+ * glyph bitmaps. Bitmap offsets are relative to the start of the bitmaps, and
+ * are 4-byte aligned. All values are in native byte order. */
+struct font_cache_header {
+	char magic[8];
+	uint32_t version;
+	struct font_cache_key key;
+	uint32_t path_length;
+	uint32_t num_entries;
+};
+
+struct font_cache_entry {
+	uint32_t glyph_index;
+	uint32_t offset;
+	uint16_t width, height, pitch;
+	int16_t x, y;
+	uint16_t advance;
+};
+
+static inline uint32_t
+align4(uint32_t size)
+{
+	return (size + 3) & ~3;
+}
+
+static bool
+map_file(struct font_cache *cache, const char *font_path)
+{
+	const struct font_cache_header *header;
+	struct stat st;
+	size_t entries_offset, data_offset;
+	void *map;
+	int fd;
+
+	if ((fd = open(cache->path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof *header)
+		goto error0;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED)
+		goto error0;
+
+	close(fd);
+	cache->map = map;
+	cache->map_size = st.st_size;
+	header = cache->map;
+
+	if (memcmp(header->magic, FONT_CACHE_MAGIC, sizeof header->magic) != 0
+	    || header->version != FONT_CACHE_VERSION
+	    || memcmp(&header->key, &cache->key, sizeof cache->key) != 0
+	    || header->path_length != strlen(font_path)) {
+		goto error1;
+	}
+
+	entries_offset = sizeof *header + align4(header->path_length);
+	data_offset = entries_offset
+	              + (size_t)header->num_entries * sizeof cache->entries[0];
+
+	if (data_offset > cache->map_size
+	    || memcmp((const char *)cache->map + sizeof *header,
+	              font_path, header->path_length) != 0) {
+		goto error1;
+	}
+
+	cache->entries = (const void *)((const uint8_t *)cache->map + entries_offset);
+	cache->num_entries = header->num_entries;
+	cache->data = (const uint8_t *)cache->map + data_offset;
+	cache->data_size = cache->map_size - data_offset;
+
+	return true;
+
+error1:
+	munmap(cache->map, cache->map_size);
+	cache->map = NULL;
+	return false;
+error0:
+	close(fd);
+	return false;
+}
+
+void
+font_cache_initialize(struct font_cache *cache)
+{
+	cache->path = NULL;
+	cache->font_path = NULL;
+	cache->map = NULL;
+	cache->map_size = 0;
+	cache->entries = NULL;
+	cache->num_entries = 0;
+	cache->data = NULL;
+	cache->data_size = 0;
+	cache->dirty = false;
+}
+
+void
+font_cache_open(struct font *font, const char *font_path,
+                uint32_t face_index, double pixel_size, double aspect)
+{
+	struct font_cache *cache = &font->cache;
+	const char *directory = font->context->cache_directory;
+	struct stat st;
+	uint64_t hash = HASH_INITIAL;
+
+	if (!directory || stat(font_path, &st) == -1)
+		return;
+
+	memset(&cache->key, 0, sizeof cache->key);
+	cache->key.file_size = st.st_size;
+	cache->key.mtime_sec = st.st_mtim.tv_sec;
+	cache->key.mtime_nsec = st.st_mtim.tv_nsec;
+	cache->key.face_index = face_index;
+	cache->key.mode = font->mode;
+	cache->key.pixel_size = pixel_size;
+	cache->key.aspect = aspect;
+
+	hash = hash_bytes(hash, font_path, strlen(font_path));
+	hash = hash_bytes(hash, &cache->key, sizeof cache->key);
+
+	if (!(cache->path = malloc(strlen(directory) + 18)))
+		return;
+
+	sprintf(cache->path, "%s/%016llx", directory, (unsigned long long)hash);
+
+	if (!(cache->font_path = strdup(font_path))) {
+		free(cache->path);
+		cache->path = NULL;
+		return;
+	}
+
+	if (map_file(cache, font_path))
+		DEBUG("Using glyph cache: %s\n", cache->path);
+}
+
+static const struct font_cache_entry *
+find_entry(struct font_cache *cache, FT_UInt glyph_index)
+{
+	const struct font_cache_entry *entry;
+	uint32_t low = 0, high = cache->num_entries;
+
+	while (low < high) {
+		entry = &cache->entries[(low + high) / 2];
+
+		if (entry->glyph_index == glyph_index)
+			return entry;
+
+		if (entry->glyph_index < glyph_index)
+			low = (low + high) / 2 + 1;
+		else
+			high = (low + high) / 2;
+	}
+
+	return NULL;
+}
+
+bool
+font_cache_load_glyph(struct font *font, FT_UInt glyph_index,
+                      struct glyph *glyph)
+{
+	struct font_cache *cache = &font->cache;
+	const struct font_cache_entry *entry;
+
+	if (!cache->map || !(entry = find_entry(cache, glyph_index)))
+		return false;
+
+	/* Renderers rely on bitmaps having exactly the pitch the font stores
+	 * them with. */
+	if (entry->pitch != glyph_pitch(font->mode, entry->width))
+		return false;
+
+	if (entry->offset > cache->data_size
+	    || (size_t)entry->pitch * entry->height
+	       > cache->data_size - entry->offset) {
+		return false;
+	}
+
+	glyph->bitmap = entry->height > 0
+	                    ? (uint8_t *)cache->data + entry->offset : NULL;
+	glyph->width = entry->width;
+	glyph->height = entry->height;
+	glyph->pitch = entry->pitch;
+	glyph->x = entry->x;
+	glyph->y = entry->y;
+	glyph->advance = entry->advance;
+
+	return true;
+}
+
+static struct glyph *
+loaded_glyph(struct font *font, uint32_t glyph_index)
+{
+	struct glyph *page;
+
+	if (glyph_index >= font->face->num_glyphs)
+		return NULL;
+
+	page = font->glyph_pages[glyph_index >> GLYPH_PAGE_SHIFT];
+
+	if (!page || !page[glyph_index & (GLYPH_PAGE_SIZE - 1)].bitmap_loaded)
+		return NULL;
+
+	return &page[glyph_index & (GLYPH_PAGE_SIZE - 1)];
+}
+
+/**
+ * Collect the glyphs to write in order of glyph index: every loaded glyph,
+ * along with any glyph in the existing file which was not loaded.
+ */
+static uint32_t
+collect_entries(struct font *font, struct font_cache_entry *entries,
+                const uint8_t **bitmaps)
+{
+	struct font_cache *cache = &font->cache;
+	const struct font_cache_entry *old = cache->entries,
+	                              *old_end = old + cache->num_entries;
+	struct glyph *glyph;
+	uint32_t glyph_index, count = 0, offset = 0;
+
+	for (glyph_index = 1; glyph_index < font->face->num_glyphs; ++glyph_index) {
+		while (old < old_end && old->glyph_index < glyph_index)
+			++old;
+
+		if ((glyph = loaded_glyph(font, glyph_index))) {
+			entries[count].width = glyph->width;
+			entries[count].height = glyph->height;
+			entries[count].pitch = glyph->pitch;
+			entries[count].x = glyph->x;
+			entries[count].y = glyph->y;
+			entries[count].advance = glyph->advance;
+			bitmaps[count] = glyph->bitmap;
+		} else if (old < old_end && old->glyph_index == glyph_index) {
+			entries[count] = *old;
+			bitmaps[count] = cache->data + old->offset;
+		} else
+			continue;
+
+		entries[count].glyph_index = glyph_index;
+		entries[count].offset = offset;
+		offset += align4(entries[count].pitch * entries[count].height);
+		++count;
+	}
+
+	return count;
+}
+
+static bool
+write_file(struct font *font, FILE *file)
+{
+	struct font_cache *cache = &font->cache;
+	struct font_cache_header header;
+	struct font_cache_entry *entries;
+	const uint8_t **bitmaps;
+	static const uint8_t padding[4];
+	uint32_t index, max_entries, size;
+	bool success = false;
+
+	max_entries = font->face->num_glyphs;
+	entries = malloc(max_entries * sizeof entries[0]);
+	bitmaps = malloc(max_entries * sizeof bitmaps[0]);
+
+	if (!entries || !bitmaps)
+		goto done;
+
+	memcpy(header.magic, FONT_CACHE_MAGIC, sizeof header.magic);
+	header.version = FONT_CACHE_VERSION;
+	header.key = cache->key;
+	header.path_length = strlen(cache->font_path);
+	header.num_entries = collect_entries(font, entries, bitmaps);
+
+	if (fwrite(&header, sizeof header, 1, file) != 1
+	    || fwrite(cache->font_path, 1, header.path_length, file)
+	       != header.path_length
+	    || fwrite(padding, 1, align4(header.path_length) - header.path_length,
+	              file) != align4(header.path_length) - header.path_length
+	    || fwrite(entries, sizeof entries[0], header.num_entries, file)
+	       != header.num_entries) {
+		goto done;
+	}
+
+	for (index = 0; index < header.num_entries; ++index) {
+		size = entries[index].pitch * entries[index].height;
+
+		if (size == 0)
+			continue;
+
+		if (fwrite(bitmaps[index], 1, size, file) != size
+		    || fwrite(padding, 1, align4(size) - size, file)
+		       != align4(size) - size) {
+			goto done;
+		}
+	}
+
+	success = true;
+
+done:
+	free(entries);
+	free(bitmaps);
+
+	return success;
+}
+
+void
+font_cache_close(struct font *font)
+{
+	struct font_cache *cache = &font->cache;
+	char *temp_path;
+	FILE *file;
+	int fd;
+
+	if (!cache->path)
+		return;
+
+	if (!cache->dirty)
+		goto done;
+
+	if (!(temp_path = malloc(strlen(cache->path) + 8)))
+		goto done;
+
+	/* Write to a temporary file first and rename it over the cache file, so
+	 * that other processes which have the old file mapped are unaffected. */
+	sprintf(temp_path, "%s.XXXXXX", cache->path);
+
+	if ((fd = mkstemp(temp_path)) == -1)
+		goto error0;
+
+	if (!(file = fdopen(fd, "w"))) {
+		close(fd);
+		goto error1;
+	}
+
+	if (!write_file(font, file)) {
+		fclose(file);
+		goto error1;
+	}
+
+	if (fclose(file) != 0 || rename(temp_path, cache->path) == -1)
+		goto error1;
+
+	DEBUG("Wrote glyph cache: %s\n", cache->path);
+	free(temp_path);
+	goto done;
+
+error1:
+	unlink(temp_path);
+error0:
+	free(temp_path);
+done:
+	if (cache->map)
+		munmap(cache->map, cache->map_size);
+
+	free(cache->font_path);
+	free(cache->path);
+}
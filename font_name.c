@@ -0,0 +1,245 @@
+/* wld: font_name.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+void
+font_name_cache_initialize(struct font_name_cache *cache)
+{
+	cache->names = NULL;
+	cache->count = 0;
+	cache->config = NULL;
+	cache->checked = 0;
+}
+
+static void
+destroy_name(struct font_name *font_name)
+{
+	FcPatternDestroy(font_name->match);
+	FcFontSetDestroy(font_name->set);
+	FcPatternDestroy(font_name->pattern);
+	free(font_name->name);
+	free(font_name);
+}
+
+/**
+ * Remove a name from the cache, freeing it if it is not in use. The context
+ * lock must be held.
+ */
+static void
+remove_name(struct font_name_cache *cache, struct font_name **link)
+{
+	struct font_name *font_name = *link;
+
+	*link = font_name->next;
+	font_name->cached = false;
+	--cache->count;
+
+	if (font_name->ref == 0)
+		destroy_name(font_name);
+}
+
+static void
+clear_names(struct font_name_cache *cache)
+{
+	while (cache->names)
+		remove_name(cache, &cache->names);
+}
+
+void
+font_name_cache_finalize(struct font_name_cache *cache)
+{
+	clear_names(cache);
+}
+
+/**
+ * Clear the cache if the fontconfig configuration has changed since the names
+ * in it were resolved, reloading the configuration if its files or font
+ * directories changed. These are only checked as often as fontconfig's rescan
+ * interval. The context lock must be held.
+ */
+static void
+check_config(struct font_name_cache *cache)
+{
+	FcConfig *config = FcConfigGetCurrent();
+	time_t now;
+	int interval;
+
+	if (config == cache->config) {
+		interval = FcConfigGetRescanInterval(config);
+		now = time(NULL);
+
+		if (interval == 0 || now - cache->checked < interval)
+			return;
+
+		cache->checked = now;
+
+		if (FcConfigUptoDate(config))
+			return;
+
+		DEBUG("Font configuration changed, clearing font name cache\n");
+
+		/* Reload the configuration, both so that names are resolved
+		 * with the new one and so that the change is only seen once. */
+		FcInitBringUptoDate();
+		config = FcConfigGetCurrent();
+	}
+
+	clear_names(cache);
+	cache->config = config;
+	cache->checked = time(NULL);
+}
+
+/**
+ * Find a name in the cache, taking a reference to it and making it the most
+ * recently used. The context lock must be held.
+ */
+static struct font_name *
+find_name(struct font_name_cache *cache, const char *name)
+{
+	struct font_name *font_name, **link;
+
+	for (link = &cache->names; (font_name = *link); link = &font_name->next) {
+		if (strcmp(font_name->name, name) == 0) {
+			*link = font_name->next;
+			font_name->next = cache->names;
+			cache->names = font_name;
+			++font_name->ref;
+
+			return font_name;
+		}
+	}
+
+	return NULL;
+}
+
+static struct font_name *
+resolve_name(const char *name)
+{
+	struct font_name *font_name;
+	FcResult result;
+
+	DEBUG("Resolving font name: %s\n", name);
+
+	if (!(font_name = malloc(sizeof *font_name)))
+		goto error0;
+
+	if (!(font_name->name = strdup(name)))
+		goto error1;
+
+	if (!(font_name->pattern = FcNameParse((const FcChar8 *)name)))
+		goto error2;
+
+	FcConfigSubstitute(NULL, font_name->pattern, FcMatchPattern);
+	FcDefaultSubstitute(font_name->pattern);
+
+	font_name->set = FcFontSort(NULL, font_name->pattern, FcTrue, NULL,
+	                            &result);
+
+	if (!font_name->set)
+		goto error3;
+
+	if (font_name->set->nfont == 0)
+		goto error4;
+
+	font_name->match = FcFontRenderPrepare(NULL, font_name->pattern,
+	                                       font_name->set->fonts[0]);
+
+	if (!font_name->match)
+		goto error4;
+
+	font_name->ref = 1;
+	font_name->cached = false;
+
+	return font_name;
+
+error4:
+	FcFontSetDestroy(font_name->set);
+error3:
+	FcPatternDestroy(font_name->pattern);
+error2:
+	free(font_name->name);
+error1:
+	free(font_name);
+error0:
+	return NULL;
+}
+
+struct font_name *
+font_name_resolve(struct wld_font_context *context, const char *name)
+{
+	struct font_name_cache *cache = &context->name_cache;
+	struct font_name *font_name, *other, **link;
+
+	pthread_mutex_lock(&context->lock);
+	check_config(cache);
+	font_name = find_name(cache, name);
+	pthread_mutex_unlock(&context->lock);
+
+	if (font_name)
+		return font_name;
+
+	/* Resolve the name without the lock, since fontconfig may take a while
+	 * to sort the fonts. */
+	if (!(font_name = resolve_name(name)))
+		return NULL;
+
+	pthread_mutex_lock(&context->lock);
+
+	/* Another thread may have resolved the same name in the meantime. */
+	if ((other = find_name(cache, name))) {
+		pthread_mutex_unlock(&context->lock);
+		destroy_name(font_name);
+
+		return other;
+	}
+
+	font_name->next = cache->names;
+	font_name->cached = true;
+	cache->names = font_name;
+
+	if (++cache->count > FONT_NAME_CACHE_SIZE) {
+		for (link = &cache->names; (*link)->next; link = &(*link)->next) {
+		}
+
+		remove_name(cache, link);
+	}
+
+	pthread_mutex_unlock(&context->lock);
+
+	return font_name;
+}
+
+void
+font_name_release(struct wld_font_context *context,
+                  struct font_name *font_name)
+{
+	bool unused;
+
+	pthread_mutex_lock(&context->lock);
+	unused = --font_name->ref == 0 && !font_name->cached;
+	pthread_mutex_unlock(&context->lock);
+
+	if (unused)
+		destroy_name(font_name);
+}
@@ -40,6 +40,19 @@ struct intel_renderer {
 	struct wld_renderer base;
 	struct intel_batch batch;
 	struct intel_buffer *target;
+
+	/**
+	 * The part of the target inside the renderer's clip, which every
+	 * operation is drawn once for each box of.
+	 */
+	pixman_region32_t clip;
+
+	/**
+	 * The runs gathered by draw_text_runs, kept between calls so that they
+	 * don't need to be allocated each time.
+	 */
+	struct text_run **runs;
+	uint32_t max_runs;
 };
 
 struct intel_buffer {
@@ -50,6 +63,8 @@ struct intel_buffer {
 
 #include "interface/buffer.h"
 #include "interface/context.h"
+#define RENDERER_IMPLEMENTS_TEXT_RUNS
+#define RENDERER_MONOCHROME_TEXT
 #include "interface/renderer.h"
 #define DRM_DRIVER_NAME intel
 #include "interface/drm.h"
@@ -102,6 +117,10 @@ context_create_renderer(struct wld_context *base)
 		goto error1;
 
 	renderer_initialize(&renderer->base, &wld_renderer_impl);
+	renderer->target = NULL;
+	pixman_region32_init(&renderer->clip);
+	renderer->runs = NULL;
+	renderer->max_runs = 0;
 
 	return &renderer->base;
 
@@ -230,6 +249,31 @@ renderer_capabilities(struct wld_renderer *renderer, struct buffer *buffer)
 	return 0;
 }
 
+/**
+ * Update the clipped part of the target after the target or clip changes.
+ */
+static bool
+update_clip(struct intel_renderer *renderer)
+{
+	struct intel_buffer *target = renderer->target;
+
+	if (!target) {
+		pixman_region32_clear(&renderer->clip);
+		return true;
+	}
+
+	pixman_region32_fini(&renderer->clip);
+	pixman_region32_init_rect(&renderer->clip, 0, 0, target->base.base.width,
+	                          target->base.base.height);
+
+	if (renderer->base.clipped) {
+		return pixman_region32_intersect(&renderer->clip, &renderer->clip,
+		                                 &renderer->base.clip);
+	}
+
+	return true;
+}
+
 bool
 renderer_set_target(struct wld_renderer *base, struct buffer *buffer)
 {
@@ -240,7 +284,25 @@ renderer_set_target(struct wld_renderer *base, struct buffer *buffer)
 
 	renderer->target = buffer ? intel_buffer(&buffer->base) : NULL;
 
-	return true;
+	return update_clip(renderer);
+}
+
+bool
+renderer_set_clip(struct wld_renderer *base, pixman_region32_t *region)
+{
+	return update_clip(intel_renderer(base));
+}
+
+static inline bool
+intersect_box(pixman_box32_t *box, const pixman_box32_t *clip,
+              int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	box->x1 = MAX(x1, clip->x1);
+	box->y1 = MAX(y1, clip->y1);
+	box->x2 = MIN(x2, clip->x2);
+	box->y2 = MIN(y2, clip->y2);
+
+	return box->x1 < box->x2 && box->y1 < box->y2;
 }
 
 void
@@ -250,9 +312,20 @@ renderer_fill_rectangle(struct wld_renderer *base, uint32_t color,
 {
 	struct intel_renderer *renderer = intel_renderer(base);
 	struct intel_buffer *dst = renderer->target;
+	pixman_box32_t *clip, box;
+	int index, num_boxes;
+
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
+
+	for (index = 0; index < num_boxes; ++index) {
+		if (!intersect_box(&box, &clip[index],
+		                   x, y, x + width, y + height)) {
+			continue;
+		}
 
-	xy_color_blt(&renderer->batch, dst->bo, dst->base.base.pitch,
-	             x, y, x + width, y + height, color);
+		xy_color_blt(&renderer->batch, dst->bo, dst->base.base.pitch,
+		             box.x1, box.y1, box.x2, box.y2, color);
+	}
 }
 
 void
@@ -269,78 +342,216 @@ renderer_copy_rectangle(struct wld_renderer *base,
 
 	struct intel_buffer *src = intel_buffer(&buffer_base->base),
 	                    *dst = renderer->target;
+	pixman_box32_t *clip, box;
+	int index, num_boxes;
 
-	xy_src_copy_blt(&renderer->batch,
-	                src->bo, src->base.base.pitch, src_x, src_y,
-	                dst->bo, dst->base.base.pitch, dst_x, dst_y, width, height);
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
+
+	for (index = 0; index < num_boxes; ++index) {
+		if (!intersect_box(&box, &clip[index],
+		                   dst_x, dst_y, dst_x + width, dst_y + height)) {
+			continue;
+		}
+
+		xy_src_copy_blt(&renderer->batch, src->bo, src->base.base.pitch,
+		                src_x + box.x1 - dst_x, src_y + box.y1 - dst_y,
+		                dst->bo, dst->base.base.pitch, box.x1, box.y1,
+		                box.x2 - box.x1, box.y2 - box.y1);
+	}
 }
 
-void
-renderer_draw_text(struct wld_renderer *base,
-                   struct font *font, uint32_t color,
-                   int32_t x, int32_t y, const char *text,
-                   uint32_t length, struct wld_extents *extents)
+static void
+setup_text(struct intel_renderer *renderer, uint32_t color,
+           const pixman_box32_t *clip)
+{
+	struct intel_buffer *dst = renderer->target;
+
+	xy_setup_blt(&renderer->batch, true, BLT_RASTER_OPERATION_SRC,
+	             0, color, dst->bo, dst->base.base.pitch,
+	             clip->x1, clip->y1, clip->x2, clip->y2);
+}
+
+/**
+ * Draw a run after a setup_text with the given clip box.
+ */
+static void
+draw_run(struct intel_renderer *renderer, struct text_run *run,
+         int32_t x, int32_t y, uint32_t color, const pixman_box32_t *clip)
 {
-	struct intel_renderer *renderer = intel_renderer(base);
 	struct intel_buffer *dst = renderer->target;
 	int ret;
 	struct glyph *glyph;
-	uint32_t row;
-	FT_UInt glyph_index;
-	uint32_t c;
+	uint32_t index, end, row, size;
 	uint8_t immediate[512];
 	uint8_t *byte;
-	int32_t origin_x = x;
-
-	xy_setup_blt(&renderer->batch, true, BLT_RASTER_OPERATION_SRC,
-	             0, color, dst->bo, dst->base.base.pitch);
+	int32_t origin_x;
+	struct box box = { clip->x1, clip->y1, clip->x2, clip->y2 };
 
-	if (length == -1)
-		length = strlen(text);
+	/* Glyphs outside the clip box are skipped before their bitmaps are
+	 * loaded or added to the batch. */
+	if (!text_run_clip(run, x, y, &box, &index, &end))
+		return;
 
-	while ((ret = FcUtf8ToUcs4((FcChar8 *)text, &c, length)) > 0 && c != '\0') {
-		text += ret;
-		length -= ret;
-		glyph_index = FT_Get_Char_Index(font->face, c);
+	for (; index < end; ++index) {
+		glyph = run->glyphs[index].glyph;
+		origin_x = x + run->glyphs[index].x;
 
-		if (!font_ensure_glyph(font, glyph_index))
+		if (!font_ensure_bitmap(run->glyphs[index].font, glyph))
 			continue;
 
-		glyph = font->glyphs[glyph_index];
+		if (glyph->width == 0 || glyph->height == 0)
+			continue;
 
-		if (glyph->bitmap.width == 0 || glyph->bitmap.rows == 0)
-			goto advance;
+		/* Anti-aliased glyphs are packed, and the others copied with
+		 * their pitch. */
+		size = run->font->mode == FONT_RENDER_GRAY
+		       ? (glyph->width + 7) / 8 * glyph->height
+		       : glyph->pitch * glyph->height;
 
-		byte = immediate;
+		if (size > sizeof immediate)
+			continue;
 
-		/* XY_TEXT_IMMEDIATE requires a pitch with no extra bytes */
-		for (row = 0; row < glyph->bitmap.rows; ++row) {
-			memcpy(byte, glyph->bitmap.buffer + (row * glyph->bitmap.pitch),
-			       (glyph->bitmap.width + 7) / 8);
-			byte += (glyph->bitmap.width + 7) / 8;
+		/* Monochrome glyphs are stored with no extra bytes in each row, as
+		 * XY_TEXT_IMMEDIATE requires. The BLT engine cannot blend, so
+		 * anti-aliased fonts are drawn with their monochrome versions,
+		 * and only thresholded if that couldn't be opened. */
+		if (run->font->mode == FONT_RENDER_GRAY) {
+			byte = immediate;
+
+			for (row = 0; row < glyph->height; ++row) {
+				glyph_pack_mono_row(byte, glyph->bitmap + row * glyph->pitch,
+				                    glyph->width);
+				byte += (glyph->width + 7) / 8;
+			}
+		} else {
+			memcpy(immediate, glyph->bitmap, glyph->pitch * glyph->height);
+			byte = immediate + glyph->pitch * glyph->height;
 		}
 
 	retry:
 		ret = xy_text_immediate_blt(&renderer->batch, dst->bo,
 		                            origin_x + glyph->x, y + glyph->y,
-		                            origin_x + glyph->x + glyph->bitmap.width,
-		                            y + glyph->y + glyph->bitmap.rows,
+		                            origin_x + glyph->x + glyph->width,
+		                            y + glyph->y + glyph->height,
 		                            (byte - immediate + 3) / 4,
 		                            (uint32_t *)immediate);
 
 		if (ret == INTEL_BATCH_NO_SPACE) {
 			intel_batch_flush(&renderer->batch);
-			xy_setup_blt(&renderer->batch, true, BLT_RASTER_OPERATION_SRC,
-			             0, color, dst->bo, dst->base.base.pitch);
+			setup_text(renderer, color, clip);
 			goto retry;
 		}
+	}
+}
+
+void
+renderer_draw_text(struct wld_renderer *base,
+                   struct font *font, uint32_t color,
+                   int32_t x, int32_t y, const char *text,
+                   uint32_t length, struct wld_extents *extents)
+{
+	struct intel_renderer *renderer = intel_renderer(base);
+	pixman_box32_t *clip;
+	struct text_run *run;
+	int index, num_boxes;
+
+	if (!(run = font_text_run(font, text, length)))
+		return;
+
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
 
-	advance:
-		origin_x += glyph->advance;
+	for (index = 0; index < num_boxes; ++index) {
+		setup_text(renderer, color, &clip[index]);
+		draw_run(renderer, run, x, y, color, &clip[index]);
 	}
 
 	if (extents)
-		extents->advance = origin_x - x;
+		extents->advance = run->advance;
+
+	text_run_release(run);
+}
+
+/**
+ * Make room for gathering the given number of runs.
+ */
+static bool
+reserve_runs(struct intel_renderer *renderer, uint32_t num_runs)
+{
+	struct text_run **runs;
+
+	if (num_runs <= renderer->max_runs)
+		return true;
+
+	runs = realloc(renderer->runs, array_size(num_runs, sizeof runs[0]));
+
+	if (!runs)
+		return false;
+
+	renderer->runs = runs;
+	renderer->max_runs = num_runs;
+
+	return true;
+}
+
+void
+renderer_draw_text_runs(struct wld_renderer *base, struct font *font,
+                        const struct wld_text_run *items, uint32_t num_items)
+{
+	struct intel_renderer *renderer = intel_renderer(base);
+	pixman_box32_t *clip;
+	struct text_run **runs;
+	uint32_t index, other, color;
+	int box, num_boxes;
+
+	/* Without room to gather the runs, draw them one at a time. */
+	if (!reserve_runs(renderer, num_items)) {
+		for (index = 0; index < num_items; ++index) {
+			renderer_draw_text(base, font, items[index].color,
+			                   items[index].x, items[index].y,
+			                   items[index].text, items[index].length,
+			                   NULL);
+		}
+
+		return;
+	}
+
+	runs = renderer->runs;
+
+	for (index = 0; index < num_items; ++index) {
+		runs[index] = font_text_run(font, items[index].text,
+		                            items[index].length);
+	}
+
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
+
+	/* The foreground color and clip rectangle are part of the BLT setup, so
+	 * draw all the runs of each color after a single setup for each box. */
+	for (index = 0; index < num_items; ++index) {
+		if (!runs[index])
+			continue;
+
+		color = items[index].color;
+
+		for (box = 0; box < num_boxes; ++box) {
+			setup_text(renderer, color, &clip[box]);
+
+			for (other = index; other < num_items; ++other) {
+				if (!runs[other] || items[other].color != color)
+					continue;
+
+				draw_run(renderer, runs[other], items[other].x,
+				         items[other].y, color, &clip[box]);
+			}
+		}
+
+		for (other = index; other < num_items; ++other) {
+			if (!runs[other] || items[other].color != color)
+				continue;
+
+			text_run_release(runs[other]);
+			runs[other] = NULL;
+		}
+	}
 }
 
 void
@@ -357,6 +568,8 @@ renderer_destroy(struct wld_renderer *base)
 	struct intel_renderer *renderer = intel_renderer(base);
 
 	intel_batch_finalize(&renderer->batch);
+	pixman_region32_fini(&renderer->clip);
+	free(renderer->runs);
 	free(renderer);
 }
 
@@ -156,7 +156,9 @@ xy_setup_blt(struct intel_batch *batch,
              uint8_t raster_operation,
              uint32_t background_color,
              uint32_t foreground_color,
-             drm_intel_bo *dst, uint16_t dst_pitch)
+             drm_intel_bo *dst, uint16_t dst_pitch,
+             uint16_t clip_x1, uint16_t clip_y1,
+             uint16_t clip_x2, uint16_t clip_y2)
 {
 	uint32_t tiling_mode, swizzle_mode;
 
@@ -173,7 +175,7 @@ xy_setup_blt(struct intel_batch *batch,
 	                           | BLT_BR00_DST_TILING_ENABLE(tiling_mode != I915_TILING_NONE)
 	                           | BLT_BR00_DWORD_LENGTH(GEN(batch, 8) ? 8 : 6),
 
-	                       BLT_BR01_CLIPPING_ENABLE(false)
+	                       BLT_BR01_CLIPPING_ENABLE(true)
 	                           | BLT_BR01_MONO_SRC_TRANSPARENCY(monochrome_source_transparency)
 	                           | BLT_BR01_COLOR_DEPTH(BLT_COLOR_DEPTH_32BIT)
 	                           | BLT_BR01_RASTER_OPERATION(raster_operation)
@@ -181,12 +183,11 @@ xy_setup_blt(struct intel_batch *batch,
 	                                                    ? dst_pitch
 	                                                    : dst_pitch >> 2),
 
-	                       /* XXX: No clipping yet */
-	                       BLT_BR24_CLP_Y1(0)
-	                           | BLT_BR24_CLP_X1(0),
+	                       BLT_BR24_CLP_Y1(clip_y1)
+	                           | BLT_BR24_CLP_X1(clip_x1),
 
-	                       BLT_BR25_CLP_Y2(0)
-	                           | BLT_BR25_CLP_X2(0));
+	                       BLT_BR25_CLP_Y2(clip_y2)
+	                           | BLT_BR25_CLP_X2(clip_x2));
 
 	intel_batch_add_dwords(batch, GEN(batch, 8) ? 2 : 1,
 	                       BLT_BR09_DST_ADDRESS(dst->offset64),
@@ -25,6 +25,8 @@ static uint32_t renderer_capabilities(struct wld_renderer *renderer,
                                       struct buffer *buffer);
 static bool renderer_set_target(struct wld_renderer *renderer,
                                 struct buffer *buffer);
+static bool renderer_set_clip(struct wld_renderer *renderer,
+                              pixman_region32_t *region);
 static void renderer_fill_rectangle(struct wld_renderer *renderer,
                                     uint32_t color, int32_t x, int32_t y,
                                     uint32_t width, uint32_t height);
@@ -46,12 +48,32 @@ static void renderer_draw_text(struct wld_renderer *renderer,
                                int32_t x, int32_t y,
                                const char *text, uint32_t length,
                                struct wld_extents *extents);
+#ifdef RENDERER_IMPLEMENTS_TEXT_RUNS
+static void renderer_draw_text_runs(struct wld_renderer *renderer,
+                                    struct font *font,
+                                    const struct wld_text_run *runs,
+                                    uint32_t num_runs);
+#endif
+#ifdef RENDERER_IMPLEMENTS_CELLS
+static void renderer_draw_cells(struct wld_renderer *renderer,
+                                struct font *font, int32_t x, int32_t y,
+                                const struct wld_cell *cells,
+                                uint32_t columns, uint32_t rows);
+#endif
+#ifdef RENDERER_IMPLEMENTS_TEXT_SCALED
+static void renderer_draw_text_scaled(struct wld_renderer *renderer,
+                                      struct font *font, uint32_t color,
+                                      int32_t x, int32_t y, float scale,
+                                      const char *text, uint32_t length,
+                                      struct wld_extents *extents);
+#endif
 static void renderer_flush(struct wld_renderer *renderer);
 static void renderer_destroy(struct wld_renderer *renderer);
 
 static const struct wld_renderer_impl wld_renderer_impl = {
 	.capabilities = &renderer_capabilities,
 	.set_target = &renderer_set_target,
+	.set_clip = &renderer_set_clip,
 	.fill_rectangle = &renderer_fill_rectangle,
 	.copy_rectangle = &renderer_copy_rectangle,
 #ifdef RENDERER_IMPLEMENTS_REGION
@@ -62,6 +84,24 @@ static const struct wld_renderer_impl wld_renderer_impl = {
 	.copy_region = &default_copy_region,
 #endif
 	.draw_text = &renderer_draw_text,
+#ifdef RENDERER_IMPLEMENTS_TEXT_RUNS
+	.draw_text_runs = &renderer_draw_text_runs,
+#else
+	.draw_text_runs = &default_draw_text_runs,
+#endif
+#ifdef RENDERER_IMPLEMENTS_CELLS
+	.draw_cells = &renderer_draw_cells,
+#else
+	.draw_cells = &default_draw_cells,
+#endif
+#ifdef RENDERER_IMPLEMENTS_TEXT_SCALED
+	.draw_text_scaled = &renderer_draw_text_scaled,
+#else
+	.draw_text_scaled = &default_draw_text_scaled,
+#endif
 	.flush = &renderer_flush,
-	.destroy = &renderer_destroy
+	.destroy = &renderer_destroy,
+#ifdef RENDERER_MONOCHROME_TEXT
+	.monochrome_text = true,
+#endif
 };
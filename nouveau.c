@@ -57,6 +57,12 @@ struct nouveau_renderer {
 	struct nouveau_object *nvc0_2d;
 
 	struct nouveau_buffer *target;
+
+	/**
+	 * The part of the target inside the renderer's clip, which every
+	 * operation is drawn once for each box of.
+	 */
+	pixman_region32_t clip;
 };
 
 struct nouveau_buffer {
@@ -68,6 +74,7 @@ struct nouveau_buffer {
 
 #include "interface/buffer.h"
 #include "interface/context.h"
+#define RENDERER_MONOCHROME_TEXT
 #include "interface/renderer.h"
 #define DRM_DRIVER_NAME nouveau
 #include "interface/drm.h"
@@ -162,6 +169,23 @@ nv_add_data(struct nouveau_pushbuf *push, void *data, uint32_t count)
 	push->cur += count;
 }
 
+static inline void
+nv_add_mono_data(struct nouveau_pushbuf *push, struct glyph *glyph,
+                 uint32_t pitch, uint32_t count)
+{
+	uint8_t *data = (uint8_t *)push->cur;
+	uint32_t row;
+
+	for (row = 0; row < glyph->height; ++row) {
+		glyph_pack_mono_row(data, glyph->bitmap + row * glyph->pitch,
+		                    glyph->width);
+		data += pitch;
+	}
+
+	memset(data, 0, (uint8_t *)(push->cur + count) - data);
+	push->cur += count;
+}
+
 static inline uint32_t
 nvc0_format(uint32_t format)
 {
@@ -227,7 +251,7 @@ nvc0_2d_initialize(struct nouveau_renderer *renderer)
 	if (ret != 0)
 		goto error0;
 
-	if (!ensure_space(renderer->pushbuf, 5))
+	if (!ensure_space(renderer->pushbuf, 6))
 		goto error1;
 
 	nvc0_2d(renderer->pushbuf, NV1_SUBCHAN_OBJECT, 1,
@@ -236,6 +260,7 @@ nvc0_2d_initialize(struct nouveau_renderer *renderer)
 	               G80_2D_OPERATION_SRCCOPY_AND);
 	nvc0_2d_inline(renderer->pushbuf, G80_2D_UNK0884, 0x3f);
 	nvc0_2d_inline(renderer->pushbuf, G80_2D_UNK0888, 1);
+	nvc0_2d_inline(renderer->pushbuf, G80_2D_CLIP_ENABLE, 1);
 
 	return true;
 
@@ -283,6 +308,7 @@ context_create_renderer(struct wld_context *base)
 
 	renderer_initialize(&renderer->base, &wld_renderer_impl);
 	renderer->target = NULL;
+	pixman_region32_init(&renderer->clip);
 
 	return &renderer->base;
 
@@ -437,6 +463,31 @@ renderer_capabilities(struct wld_renderer *renderer,
 	return 0;
 }
 
+/**
+ * Update the clipped part of the target after the target or clip changes.
+ */
+static bool
+update_clip(struct nouveau_renderer *renderer)
+{
+	struct nouveau_buffer *target = renderer->target;
+
+	if (!target) {
+		pixman_region32_clear(&renderer->clip);
+		return true;
+	}
+
+	pixman_region32_fini(&renderer->clip);
+	pixman_region32_init_rect(&renderer->clip, 0, 0, target->base.base.width,
+	                          target->base.base.height);
+
+	if (renderer->base.clipped) {
+		return pixman_region32_intersect(&renderer->clip, &renderer->clip,
+		                                 &renderer->base.clip);
+	}
+
+	return true;
+}
+
 bool
 renderer_set_target(struct wld_renderer *base, struct buffer *buffer)
 {
@@ -447,7 +498,23 @@ renderer_set_target(struct wld_renderer *base, struct buffer *buffer)
 
 	renderer->target = buffer ? nouveau_buffer(&buffer->base) : NULL;
 
-	return true;
+	return update_clip(renderer);
+}
+
+bool
+renderer_set_clip(struct wld_renderer *base, pixman_region32_t *region)
+{
+	return update_clip(nouveau_renderer(base));
+}
+
+/**
+ * Clip the following 2D operations to the box, which takes 5 dwords.
+ */
+static inline void
+nvc0_2d_clip(struct nouveau_renderer *renderer, const pixman_box32_t *box)
+{
+	nvc0_2d(renderer->pushbuf, G80_2D_CLIP_X, 4, box->x1, box->y1,
+	        box->x2 - box->x1, box->y2 - box->y1);
 }
 
 static inline void
@@ -483,9 +550,13 @@ renderer_fill_rectangle(struct wld_renderer *base, uint32_t color,
 {
 	struct nouveau_renderer *renderer = nouveau_renderer(base);
 	struct nouveau_buffer *dst = renderer->target;
+	pixman_box32_t *clip;
 	uint32_t format;
+	int index, num_boxes;
+
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
 
-	if (!ensure_space(renderer->pushbuf, 18))
+	if (num_boxes == 0 || !ensure_space(renderer->pushbuf, 18))
 		return;
 
 	format = nvc0_format(dst->base.base.format);
@@ -499,8 +570,14 @@ renderer_fill_rectangle(struct wld_renderer *base, uint32_t color,
 	if (nouveau_pushbuf_validate(renderer->pushbuf) != 0)
 		return;
 
-	nvc0_2d(renderer->pushbuf, G80_2D_DRAW_POINT32_X(0), 4,
-	        x, y, x + width, y + height);
+	for (index = 0; index < num_boxes; ++index) {
+		if (!ensure_space(renderer->pushbuf, 10))
+			return;
+
+		nvc0_2d_clip(renderer, &clip[index]);
+		nvc0_2d(renderer->pushbuf, G80_2D_DRAW_POINT32_X(0), 4,
+		        x, y, x + width, y + height);
+	}
 }
 
 void
@@ -517,9 +594,13 @@ renderer_copy_rectangle(struct wld_renderer *base,
 
 	struct nouveau_buffer *src = nouveau_buffer(&buffer_base->base),
 	                      *dst = renderer->target;
+	pixman_box32_t *clip;
 	uint32_t src_format, dst_format;
+	int index, num_boxes;
 
-	if (!ensure_space(renderer->pushbuf, 33))
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
+
+	if (num_boxes == 0 || !ensure_space(renderer->pushbuf, 33))
 		return;
 
 	src_format = nvc0_format(src->base.base.format);
@@ -537,12 +618,74 @@ renderer_copy_rectangle(struct wld_renderer *base,
 	nvc0_2d_inline(renderer->pushbuf, G80_2D_BLIT_CONTROL,
 	               G80_2D_BLIT_CONTROL_ORIGIN_CENTER
 	                   | G80_2D_BLIT_CONTROL_FILTER_POINT_SAMPLE);
-	nvc0_2d(renderer->pushbuf, G80_2D_BLIT_DST_X, 12,
-	        dst_x, dst_y, width, height, 0, 1, 0, 1, 0, src_x, 0, src_y);
+
+	for (index = 0; index < num_boxes; ++index) {
+		if (!ensure_space(renderer->pushbuf, 18))
+			return;
+
+		nvc0_2d_clip(renderer, &clip[index]);
+		nvc0_2d(renderer->pushbuf, G80_2D_BLIT_DST_X, 12,
+		        dst_x, dst_y, width, height, 0, 1, 0, 1, 0, src_x, 0, src_y);
+	}
 
 	renderer_flush(base);
 }
 
+/**
+ * Push the glyphs of the run from index up to end, returning false if the
+ * push buffer runs out of space.
+ */
+static bool
+draw_glyphs(struct nouveau_renderer *renderer, struct font *font,
+            struct text_run *run, int32_t x, int32_t y,
+            uint32_t index, uint32_t end)
+{
+	struct glyph *glyph;
+	uint32_t count, pitch;
+	int32_t origin_x;
+
+	for (; index < end; ++index) {
+		glyph = run->glyphs[index].glyph;
+		origin_x = x + run->glyphs[index].x;
+
+		if (!font_ensure_bitmap(run->glyphs[index].font, glyph)
+		    || glyph->width == 0 || glyph->height == 0) {
+			continue;
+		}
+
+		/* The 2D engine cannot blend, so anti-aliased fonts are drawn
+		 * with their monochrome versions. If that couldn't be opened,
+		 * glyphs are thresholded to a 1-bit mask as they are pushed. */
+		if (font->mode == FONT_RENDER_GRAY)
+			pitch = (glyph->width + 7) / 8;
+		else
+			pitch = glyph->pitch;
+
+		count = (pitch * glyph->height + 3) / 4;
+
+		if (!ensure_space(renderer->pushbuf, 12 + count))
+			return false;
+
+		nvc0_2d(renderer->pushbuf, G80_2D_SIFC_WIDTH, 10,
+		        /* Use the pitch instead of width to ensure the correct
+			 * alignment is used. */
+		        pitch * 8, glyph->height,
+		        0, 1, 0, 1,
+		        0, origin_x + glyph->x, 0, y + glyph->y);
+		nv_add_dword(renderer->pushbuf,
+		             nvc0_command(GF100_COMMAND_TYPE_NON_INCREASING,
+		                          GF100_SUBCHANNEL_2D,
+		                          G80_2D_SIFC_DATA, count));
+
+		if (font->mode == FONT_RENDER_GRAY)
+			nv_add_mono_data(renderer->pushbuf, glyph, pitch, count);
+		else
+			nv_add_data(renderer->pushbuf, glyph->bitmap, count);
+	}
+
+	return true;
+}
+
 void
 renderer_draw_text(struct wld_renderer *base,
                    struct font *font, uint32_t color,
@@ -552,15 +695,23 @@ renderer_draw_text(struct wld_renderer *base,
 	struct nouveau_renderer *renderer = nouveau_renderer(base);
 	struct nouveau_buffer *dst = renderer->target;
 	uint32_t format;
-	int ret;
-	struct glyph *glyph;
-	FT_UInt glyph_index;
-	uint32_t c, count;
-	int32_t origin_x = x;
+	struct text_run *run;
+	uint32_t index, end;
+	pixman_box32_t *clip;
+	struct box box;
+	int clip_index, num_boxes;
 
-	if (!ensure_space(renderer->pushbuf, 17))
+	if (!(run = font_text_run(font, text, length)))
 		return;
 
+	if (extents)
+		extents->advance = run->advance;
+
+	clip = pixman_region32_rectangles(&renderer->clip, &num_boxes);
+
+	if (num_boxes == 0 || !ensure_space(renderer->pushbuf, 17))
+		goto done;
+
 	format = nvc0_format(dst->base.base.format);
 
 	nouveau_bufctx_reset(renderer->bufctx, 0);
@@ -576,47 +727,30 @@ renderer_draw_text(struct wld_renderer *base,
 	nouveau_pushbuf_bufctx(renderer->pushbuf, renderer->bufctx);
 
 	if (nouveau_pushbuf_validate(renderer->pushbuf) != 0)
-		return;
-
-	if (length == -1)
-		length = strlen(text);
+		goto done;
 
-	while ((ret = FcUtf8ToUcs4((FcChar8 *)text, &c, length)) > 0 && c != '\0') {
-		text += ret;
-		length -= ret;
-		glyph_index = FT_Get_Char_Index(font->face, c);
+	for (clip_index = 0; clip_index < num_boxes; ++clip_index) {
+		box.x1 = clip[clip_index].x1;
+		box.y1 = clip[clip_index].y1;
+		box.x2 = clip[clip_index].x2;
+		box.y2 = clip[clip_index].y2;
 
-		if (!font_ensure_glyph(font, glyph_index))
+		/* Glyphs outside the clip box are skipped before their bitmaps are
+		 * loaded or added to the push buffer. */
+		if (!text_run_clip(run, x, y, &box, &index, &end))
 			continue;
 
-		glyph = font->glyphs[glyph_index];
-
-		if (glyph->bitmap.width == 0 || glyph->bitmap.rows == 0)
-			goto advance;
+		if (!ensure_space(renderer->pushbuf, 5))
+			goto done;
 
-		count = (glyph->bitmap.pitch * glyph->bitmap.rows + 3) / 4;
-
-		if (!ensure_space(renderer->pushbuf, 12 + count))
-			return;
+		nvc0_2d_clip(renderer, &clip[clip_index]);
 
-		nvc0_2d(renderer->pushbuf, G80_2D_SIFC_WIDTH, 10,
-		        /* Use the pitch instead of width to ensure the correct
-			 * alignment is used. */
-		        glyph->bitmap.pitch * 8, glyph->bitmap.rows,
-		        0, 1, 0, 1,
-		        0, origin_x + glyph->x, 0, y + glyph->y);
-		nv_add_dword(renderer->pushbuf,
-		             nvc0_command(GF100_COMMAND_TYPE_NON_INCREASING,
-		                          GF100_SUBCHANNEL_2D,
-		                          G80_2D_SIFC_DATA, count));
-		nv_add_data(renderer->pushbuf, glyph->bitmap.buffer, count);
-
-	advance:
-		origin_x += glyph->advance;
+		if (!draw_glyphs(renderer, font, run, x, y, index, end))
+			break;
 	}
 
-	if (extents)
-		extents->advance = origin_x - x;
+done:
+	text_run_release(run);
 }
 
 void
@@ -637,6 +771,7 @@ renderer_destroy(struct wld_renderer *base)
 	nouveau_bufctx_del(&renderer->bufctx);
 	nouveau_pushbuf_del(&renderer->pushbuf);
 	nouveau_object_del(&renderer->channel);
+	pixman_region32_fini(&renderer->clip);
 	free(renderer);
 }
 
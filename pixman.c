@@ -32,10 +32,119 @@
 		.blue = ((c >> 0) & 0xff) * 0x101,   \
 	}
 
+#define GLYPH_CACHE_DEFAULT_SIZE (4 * 1024 * 1024)
+#define SOLID_CACHE_SIZE 32
+#define BAND_MIN_AREA (256 * 256)
+#define SCRATCH_ALIGNMENT 16
+#define SCRATCH_MIN_SIZE 4096
+
+struct glyph_entry {
+	uint64_t font_id;
+	struct glyph *glyph;
+	uint32_t size, last_used;
+};
+
+struct solid_entry {
+	uint32_t color, last_used;
+	pixman_image_t *image;
+};
+
+struct pixman_renderer;
+
+/**
+ * A drawing operation which may be split into bands. The draw function draws
+ * it into the given image, which is either the target or an image of the same
+ * pixels clipped to one band. Only the fields the operation needs are set.
+ */
+struct band_op {
+	void (*draw)(struct pixman_renderer *renderer, pixman_image_t *dst,
+	             const struct band_op *op);
+
+	/**
+	 * The bounds of the pixels the operation may write.
+	 */
+	pixman_box32_t extents;
+
+	pixman_image_t *src, *mask;
+	pixman_color_t color;
+	const pixman_box32_t *boxes;
+	const pixman_glyph_t *glyphs;
+	int count;
+	int32_t x, y;
+	uint32_t width, height;
+};
+
+struct band {
+	struct pixman_renderer *renderer;
+	pthread_t thread;
+	uint32_t generation;
+
+	/**
+	 * An image of the target's pixels, clipped to the band.
+	 */
+	pixman_image_t *target;
+	pixman_box32_t box;
+};
+
+struct scratch_block {
+	struct scratch_block *next;
+	size_t size;
+	uint8_t *data;
+};
+
 struct pixman_renderer {
 	struct wld_renderer base;
 	pixman_image_t *target;
 	pixman_glyph_cache_t *glyph_cache;
+
+	/**
+	 * Memory for the temporary arrays of an operation, which is reused by
+	 * the next operation, so that drawing stops allocating once it is as
+	 * large as the largest operation needs. If an operation needs more, a
+	 * new block is added so that its earlier allocations stay put, and the
+	 * blocks are merged into one at the start of the next operation.
+	 */
+	struct {
+		struct scratch_block *blocks;
+		size_t used;
+	} scratch;
+
+	/**
+	 * The glyphs in the glyph cache, in an open-addressed hash table, along
+	 * with the memory they use and when they were last drawn. Pixman only
+	 * limits the number of glyphs in its cache, so the least recently used
+	 * ones are removed from it when they take up more than max_glyph_size
+	 * bytes.
+	 */
+	struct glyph_entry *glyph_entries;
+	uint32_t glyph_table_size, num_glyphs;
+	size_t glyph_size, max_glyph_size;
+	uint32_t clock;
+
+	/**
+	 * Solid fill images recently used as sources, by color. Entries are
+	 * filled in order, and once they are all in use, the least recently
+	 * used one is replaced when a new color is needed.
+	 */
+	struct solid_entry solids[SOLID_CACHE_SIZE];
+	uint32_t solid_clock;
+
+	/**
+	 * With wld_pixman_set_threads, the target is split into horizontal
+	 * bands, and large operations are drawn into each band by its own
+	 * thread. The first band is drawn by the renderer's caller, and the
+	 * others by worker threads, which start drawing when the generation
+	 * changes. The operation is finished once none are pending.
+	 */
+	struct {
+		struct band *bands;
+		uint32_t num_bands;
+		pthread_mutex_t lock;
+		pthread_cond_t start, done;
+		const struct band_op *op;
+		uint32_t generation, pending;
+		bool quit;
+	} workers;
 };
 
 struct pixman_buffer {
@@ -51,6 +160,9 @@ struct pixman_map {
 
 #include "interface/context.h"
 #define RENDERER_IMPLEMENTS_REGION
+#define RENDERER_IMPLEMENTS_TEXT_RUNS
+#define RENDERER_IMPLEMENTS_CELLS
+#define RENDERER_IMPLEMENTS_TEXT_SCALED
 #include "interface/buffer.h"
 #include "interface/renderer.h"
 IMPL(pixman_renderer, wld_renderer)
@@ -74,6 +186,25 @@ context_create_renderer(struct wld_context *context)
 
 	renderer_initialize(&renderer->base, &wld_renderer_impl);
 	renderer->target = NULL;
+	renderer->glyph_entries = NULL;
+	renderer->glyph_table_size = 0;
+	renderer->num_glyphs = 0;
+	renderer->glyph_size = 0;
+	renderer->max_glyph_size = GLYPH_CACHE_DEFAULT_SIZE;
+	renderer->clock = 0;
+	renderer->scratch.blocks = NULL;
+	renderer->scratch.used = 0;
+	memset(renderer->solids, 0, sizeof renderer->solids);
+	renderer->solid_clock = 0;
+	renderer->workers.bands = NULL;
+	renderer->workers.num_bands = 0;
+	pthread_mutex_init(&renderer->workers.lock, NULL);
+	pthread_cond_init(&renderer->workers.start, NULL);
+	pthread_cond_init(&renderer->workers.done, NULL);
+	renderer->workers.op = NULL;
+	renderer->workers.generation = 0;
+	renderer->workers.pending = 0;
+	renderer->workers.quit = false;
 
 	return &renderer->base;
 
@@ -248,18 +379,470 @@ error0:
 	return NULL;
 }
 
+static bool
+add_scratch_block(struct pixman_renderer *renderer, size_t size)
+{
+	struct scratch_block *block;
+
+	if (!(block = malloc(sizeof *block + SCRATCH_ALIGNMENT - 1 + size)))
+		return false;
+
+	block->data = (uint8_t *)(((uintptr_t)(block + 1) + SCRATCH_ALIGNMENT - 1)
+	                          & ~(uintptr_t)(SCRATCH_ALIGNMENT - 1));
+	block->size = size;
+	block->next = renderer->scratch.blocks;
+	renderer->scratch.blocks = block;
+	renderer->scratch.used = 0;
+
+	return true;
+}
+
+static void
+free_scratch(struct pixman_renderer *renderer)
+{
+	struct scratch_block *block, *next;
+
+	for (block = renderer->scratch.blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+
+	renderer->scratch.blocks = NULL;
+	renderer->scratch.used = 0;
+}
+
+/**
+ * Make all of the scratch memory available again. This must be called at the
+ * start of every operation that uses scratch memory.
+ */
+static void
+reset_scratch(struct pixman_renderer *renderer)
+{
+	struct scratch_block *block;
+	size_t size = 0;
+
+	renderer->scratch.used = 0;
+
+	if (!renderer->scratch.blocks || !renderer->scratch.blocks->next)
+		return;
+
+	for (block = renderer->scratch.blocks; block; block = block->next)
+		size += block->size;
+
+	free_scratch(renderer);
+	add_scratch_block(renderer, size);
+}
+
+/**
+ * Returns space for the given number of bytes, which lasts until the next
+ * call to reset_scratch.
+ */
+static void *
+scratch_alloc(struct pixman_renderer *renderer, size_t size)
+{
+	struct scratch_block *block = renderer->scratch.blocks;
+	void *data;
+
+	if (size > SIZE_MAX - SCRATCH_ALIGNMENT)
+		return NULL;
+
+	size = (size + SCRATCH_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+
+	if (!block || block->size - renderer->scratch.used < size) {
+		if (!add_scratch_block(renderer,
+		                       MAX(size, block ? block->size * 2
+		                                       : SCRATCH_MIN_SIZE))) {
+			return NULL;
+		}
+
+		block = renderer->scratch.blocks;
+	}
+
+	data = block->data + renderer->scratch.used;
+	renderer->scratch.used += size;
+
+	return data;
+}
+
+/**
+ * Returns a solid fill image of the given color, which belongs to the
+ * renderer, or NULL if one could not be created.
+ */
+static pixman_image_t *
+solid_image(struct pixman_renderer *renderer, uint32_t color)
+{
+	pixman_color_t pixman_color = PIXMAN_COLOR(color);
+	struct solid_entry *entry, *oldest = &renderer->solids[0];
+	const uint32_t now = ++renderer->solid_clock;
+	pixman_image_t *image;
+
+	for (entry = renderer->solids;
+	     entry < &renderer->solids[SOLID_CACHE_SIZE]; ++entry) {
+		if (!entry->image) {
+			oldest = entry;
+			break;
+		}
+
+		if (entry->color == color) {
+			entry->last_used = now;
+			return entry->image;
+		}
+
+		if (now - entry->last_used > now - oldest->last_used)
+			oldest = entry;
+	}
+
+	if (!(image = pixman_image_create_solid_fill(&pixman_color)))
+		return NULL;
+
+	if (oldest->image)
+		pixman_image_unref(oldest->image);
+
+	oldest->color = color;
+	oldest->last_used = now;
+	oldest->image = image;
+
+	return image;
+}
+
+static void
+draw_band(struct band *band, const struct band_op *op)
+{
+	const pixman_box32_t *extents = &op->extents;
+
+	if (extents->y1 < band->box.y2 && extents->y2 > band->box.y1)
+		op->draw(band->renderer, band->target, op);
+}
+
+static void *
+band_thread(void *data)
+{
+	struct band *band = data;
+	struct pixman_renderer *renderer = band->renderer;
+	uint32_t generation = band->generation;
+
+	pthread_mutex_lock(&renderer->workers.lock);
+
+	for (;;) {
+		while (renderer->workers.generation == generation
+		       && !renderer->workers.quit) {
+			pthread_cond_wait(&renderer->workers.start,
+			                  &renderer->workers.lock);
+		}
+
+		if (renderer->workers.quit)
+			break;
+
+		generation = renderer->workers.generation;
+		pthread_mutex_unlock(&renderer->workers.lock);
+		draw_band(band, renderer->workers.op);
+		pthread_mutex_lock(&renderer->workers.lock);
+
+		if (--renderer->workers.pending == 0)
+			pthread_cond_signal(&renderer->workers.done);
+	}
+
+	pthread_mutex_unlock(&renderer->workers.lock);
+
+	return NULL;
+}
+
+/**
+ * Create the images of the bands for the current target, clipped to their
+ * band and the renderer's clip.
+ */
+static void
+update_bands(struct pixman_renderer *renderer)
+{
+	pixman_image_t *target = renderer->target;
+	pixman_region32_t clip;
+	struct band *band;
+	uint32_t index, width, height;
+
+	for (index = 0; index < renderer->workers.num_bands; ++index) {
+		band = &renderer->workers.bands[index];
+
+		if (band->target) {
+			pixman_image_unref(band->target);
+			band->target = NULL;
+		}
+
+		if (!target)
+			continue;
+
+		width = pixman_image_get_width(target);
+		height = pixman_image_get_height(target);
+		band->box.x1 = 0;
+		band->box.y1 = height * index / renderer->workers.num_bands;
+		band->box.x2 = width;
+		band->box.y2 = height * (index + 1) / renderer->workers.num_bands;
+		band->target = pixman_image_create_bits(pixman_image_get_format(target),
+		                                        width, height,
+		                                        pixman_image_get_data(target),
+		                                        pixman_image_get_stride(target));
+
+		if (!band->target)
+			continue;
+
+		pixman_region32_init_with_extents(&clip, &band->box);
+
+		if (renderer->base.clipped)
+			pixman_region32_intersect(&clip, &clip, &renderer->base.clip);
+
+		pixman_image_set_clip_region32(band->target, &clip);
+		pixman_region32_fini(&clip);
+	}
+}
+
+static void
+stop_workers(struct pixman_renderer *renderer)
+{
+	struct band *bands = renderer->workers.bands;
+	uint32_t index;
+
+	if (!bands)
+		return;
+
+	pthread_mutex_lock(&renderer->workers.lock);
+	renderer->workers.quit = true;
+	pthread_cond_broadcast(&renderer->workers.start);
+	pthread_mutex_unlock(&renderer->workers.lock);
+
+	for (index = 1; index < renderer->workers.num_bands; ++index)
+		pthread_join(bands[index].thread, NULL);
+
+	for (index = 0; index < renderer->workers.num_bands; ++index) {
+		if (bands[index].target)
+			pixman_image_unref(bands[index].target);
+	}
+
+	free(bands);
+	renderer->workers.bands = NULL;
+	renderer->workers.num_bands = 0;
+	renderer->workers.quit = false;
+}
+
+/**
+ * Draw an operation, splitting it into bands if it is large enough to be
+ * worth the synchronization.
+ */
+static void
+run_op(struct pixman_renderer *renderer, struct band_op *op)
+{
+	pixman_box32_t *extents = &op->extents;
+	int64_t area;
+	uint32_t index;
+
+	extents->x1 = MAX(extents->x1, 0);
+	extents->y1 = MAX(extents->y1, 0);
+	extents->x2 = MIN(extents->x2, pixman_image_get_width(renderer->target));
+	extents->y2 = MIN(extents->y2, pixman_image_get_height(renderer->target));
+
+	if (renderer->base.clipped) {
+		extents->x1 = MAX(extents->x1, renderer->base.clip.extents.x1);
+		extents->y1 = MAX(extents->y1, renderer->base.clip.extents.y1);
+		extents->x2 = MIN(extents->x2, renderer->base.clip.extents.x2);
+		extents->y2 = MIN(extents->y2, renderer->base.clip.extents.y2);
+	}
+
+	if (extents->x1 >= extents->x2 || extents->y1 >= extents->y2)
+		return;
+
+	area = (int64_t)(extents->x2 - extents->x1) * (extents->y2 - extents->y1);
+
+	/* Copies within the target can't be split, since one band may read
+	 * pixels that another is writing. */
+	if (renderer->workers.num_bands == 0 || area < BAND_MIN_AREA
+	    || (op->src && pixman_image_get_data(op->src)
+	                   == pixman_image_get_data(renderer->target))) {
+		op->draw(renderer, renderer->target, op);
+		return;
+	}
+
+	for (index = 0; index < renderer->workers.num_bands; ++index) {
+		if (!renderer->workers.bands[index].target) {
+			op->draw(renderer, renderer->target, op);
+			return;
+		}
+	}
+
+	/* Pixman computes some properties of an image the first time it is used,
+	 * so use the sources here first rather than in every thread at once. */
+	if (op->src) {
+		pixman_image_composite32(PIXMAN_OP_DST, op->src, op->mask,
+		                         renderer->target, 0, 0, 0, 0, 0, 0, 0, 0);
+	}
+
+	pthread_mutex_lock(&renderer->workers.lock);
+	renderer->workers.op = op;
+	renderer->workers.pending = renderer->workers.num_bands - 1;
+	++renderer->workers.generation;
+	pthread_cond_broadcast(&renderer->workers.start);
+	pthread_mutex_unlock(&renderer->workers.lock);
+
+	draw_band(&renderer->workers.bands[0], op);
+
+	pthread_mutex_lock(&renderer->workers.lock);
+
+	while (renderer->workers.pending > 0)
+		pthread_cond_wait(&renderer->workers.done, &renderer->workers.lock);
+
+	pthread_mutex_unlock(&renderer->workers.lock);
+}
+
+static void
+draw_fill(struct pixman_renderer *renderer, pixman_image_t *dst,
+          const struct band_op *op)
+{
+	pixman_image_fill_boxes(PIXMAN_OP_SRC, dst, &op->color,
+	                        op->count, op->boxes);
+}
+
+/**
+ * Fill the boxes with the given color.
+ */
+static void
+fill_boxes(struct pixman_renderer *renderer, uint32_t color,
+           const pixman_box32_t *boxes, int count)
+{
+	struct band_op op = {
+		.draw = &draw_fill,
+		.extents = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN },
+		.color = PIXMAN_COLOR(color),
+		.boxes = boxes,
+		.count = count,
+	};
+	int index;
+
+	for (index = 0; index < count; ++index) {
+		op.extents.x1 = MIN(op.extents.x1, boxes[index].x1);
+		op.extents.y1 = MIN(op.extents.y1, boxes[index].y1);
+		op.extents.x2 = MAX(op.extents.x2, boxes[index].x2);
+		op.extents.y2 = MAX(op.extents.y2, boxes[index].y2);
+	}
+
+	run_op(renderer, &op);
+}
+
+static void
+draw_copy(struct pixman_renderer *renderer, pixman_image_t *dst,
+          const struct band_op *op)
+{
+	const pixman_box32_t *box;
+	int index;
+
+	for (index = 0; index < op->count; ++index) {
+		box = &op->boxes[index];
+		pixman_image_composite32(PIXMAN_OP_SRC, op->src, NULL, dst,
+		                         box->x1, box->y1, 0, 0,
+		                         box->x1 + op->x, box->y1 + op->y,
+		                         box->x2 - box->x1, box->y2 - box->y1);
+	}
+}
+
+/**
+ * Copy the boxes of the source image to the target, offset by (x, y).
+ */
+static void
+copy_boxes(struct pixman_renderer *renderer, pixman_image_t *src,
+           const pixman_box32_t *boxes, int count,
+           const pixman_box32_t *extents, int32_t x, int32_t y)
+{
+	struct band_op op = {
+		.draw = &draw_copy,
+		.extents = {
+			extents->x1 + x, extents->y1 + y,
+			extents->x2 + x, extents->y2 + y,
+		},
+		.src = src,
+		.boxes = boxes,
+		.count = count,
+		.x = x,
+		.y = y,
+	};
+
+	run_op(renderer, &op);
+}
+
+EXPORT
+bool
+wld_pixman_set_threads(struct wld_renderer *base, uint32_t num_threads)
+{
+	struct pixman_renderer *renderer = pixman_renderer(base);
+	struct band *bands;
+	uint32_t index;
+
+	stop_workers(renderer);
+
+	if (num_threads == 0)
+		return true;
+
+	if (!(bands = calloc(num_threads + 1, sizeof bands[0])))
+		return false;
+
+	renderer->workers.bands = bands;
+	renderer->workers.num_bands = 1;
+
+	for (index = 0; index <= num_threads; ++index) {
+		bands[index].renderer = renderer;
+		bands[index].generation = renderer->workers.generation;
+	}
+
+	for (index = 1; index <= num_threads; ++index) {
+		if (pthread_create(&bands[index].thread, NULL,
+		                   &band_thread, &bands[index]) != 0) {
+			goto error0;
+		}
+
+		++renderer->workers.num_bands;
+	}
+
+	update_bands(renderer);
+
+	return true;
+
+error0:
+	stop_workers(renderer);
+	return false;
+}
+
 bool
 renderer_set_target(struct wld_renderer *base, struct buffer *buffer)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
 
-	if (renderer->target)
+	/* The target's image belongs to its buffer, so its clip is removed
+	 * before it is used for anything else. */
+	if (renderer->target) {
+		pixman_image_set_clip_region32(renderer->target, NULL);
 		pixman_image_unref(renderer->target);
+	}
 
-	if (buffer)
-		return (renderer->target = pixman_image(buffer));
+	renderer->target = buffer ? pixman_image(buffer) : NULL;
+
+	if (renderer->target && base->clipped
+	    && !pixman_image_set_clip_region32(renderer->target, &base->clip)) {
+		pixman_image_unref(renderer->target);
+		renderer->target = NULL;
+	}
+
+	update_bands(renderer);
+
+	return !buffer || renderer->target;
+}
+
+bool
+renderer_set_clip(struct wld_renderer *base, pixman_region32_t *region)
+{
+	struct pixman_renderer *renderer = pixman_renderer(base);
+
+	if (renderer->target
+	    && !pixman_image_set_clip_region32(renderer->target, region)) {
+		return false;
+	}
+
+	update_bands(renderer);
 
-	renderer->target = NULL;
 	return true;
 }
 
@@ -269,11 +852,9 @@ renderer_fill_rectangle(struct wld_renderer *base, uint32_t color,
                         uint32_t width, uint32_t height)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
-	pixman_color_t pixman_color = PIXMAN_COLOR(color);
 	pixman_box32_t box = { x, y, x + width, y + height };
 
-	pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
-	                        &pixman_color, 1, &box);
+	fill_boxes(renderer, color, &box, 1);
 }
 
 void
@@ -281,13 +862,11 @@ renderer_fill_region(struct wld_renderer *base, uint32_t color,
                      pixman_region32_t *region)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
-	pixman_color_t pixman_color = PIXMAN_COLOR(color);
 	pixman_box32_t *boxes;
 	int num_boxes;
 
 	boxes = pixman_region32_rectangles(region, &num_boxes);
-	pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
-	                        &pixman_color, num_boxes, boxes);
+	fill_boxes(renderer, color, boxes, num_boxes);
 }
 
 void
@@ -297,13 +876,13 @@ renderer_copy_rectangle(struct wld_renderer *base, struct buffer *buffer,
                         uint32_t width, uint32_t height)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
-	pixman_image_t *src = pixman_image(buffer), *dst = renderer->target;
+	pixman_image_t *src = pixman_image(buffer);
+	pixman_box32_t box = { src_x, src_y, src_x + width, src_y + height };
 
 	if (!src)
 		return;
 
-	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
-	                         src_x, src_y, 0, 0, dst_x, dst_y, width, height);
+	copy_boxes(renderer, src, &box, 1, &box, dst_x - src_x, dst_y - src_y);
 }
 
 void
@@ -312,26 +891,18 @@ renderer_copy_region(struct wld_renderer *base, struct buffer *buffer,
                      pixman_region32_t *region)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
-	pixman_image_t *src = pixman_image(buffer), *dst = renderer->target;
-	pixman_region32_t clip;
+	pixman_image_t *src = pixman_image(buffer);
+	pixman_box32_t *boxes;
+	int num_boxes;
 
 	if (!src)
 		return;
 
-	pixman_region32_init(&clip);
-	pixman_region32_copy(&clip, region);
-	pixman_region32_translate(&clip, dst_x, dst_y);
-
-	pixman_image_set_clip_region32(dst, &clip);
-	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
-	                         region->extents.x1, region->extents.y1, 0, 0,
-	                         region->extents.x1 + dst_x,
-	                         region->extents.y1 + dst_y,
-	                         region->extents.x2 - region->extents.x1,
-	                         region->extents.y2 - region->extents.y1);
-	pixman_image_set_clip_region32(dst, NULL);
-
-	pixman_region32_fini(&clip);
+	/* Copying each box on its own is what a clip region would do, without
+	 * having to copy the region into the target's clip. */
+	boxes = pixman_region32_rectangles(region, &num_boxes);
+	copy_boxes(renderer, src, boxes, num_boxes, &region->extents,
+	           dst_x, dst_y);
 }
 
 static inline uint8_t
@@ -344,6 +915,393 @@ reverse(uint8_t byte)
 	return byte;
 }
 
+static pixman_image_t *
+glyph_image(struct font *font, struct glyph *glyph)
+{
+	uint8_t *src, *dst;
+	uint32_t row, byte_index, pitch;
+	pixman_image_t *image;
+
+	/* Anti-aliased glyphs are already stored in pixman's a8 format. */
+	if (font->mode == FONT_RENDER_GRAY) {
+		return pixman_image_create_bits(PIXMAN_a8, glyph->width, glyph->height,
+		                                (uint32_t *)glyph->bitmap,
+		                                glyph->pitch);
+	}
+
+	image = pixman_image_create_bits(PIXMAN_a1, glyph->width, glyph->height, NULL, 0);
+
+	if (!image)
+		return NULL;
+
+	pitch = pixman_image_get_stride(image);
+	src = glyph->bitmap;
+	dst = (uint8_t *)pixman_image_get_data(image);
+
+	for (row = 0; row < glyph->height; ++row) {
+		/* Pixman's A1 format expects the bits in the opposite order
+		 * that Freetype gives us. Sigh... */
+		for (byte_index = 0; byte_index < glyph->pitch; ++byte_index)
+			dst[byte_index] = reverse(src[byte_index]);
+
+		dst += pitch;
+		src += glyph->pitch;
+	}
+
+	return image;
+}
+
+static struct glyph_entry *
+find_glyph_entry(struct glyph_entry *entries, uint32_t size,
+                 uint64_t font_id, struct glyph *glyph)
+{
+	uint32_t index;
+
+	index = ((uint32_t)((uintptr_t)glyph >> 4) ^ (uint32_t)font_id)
+	        * 2654435761u & (size - 1);
+
+	while (entries[index].glyph
+	       && (entries[index].glyph != glyph
+	           || entries[index].font_id != font_id)) {
+		index = (index + 1) & (size - 1);
+	}
+
+	return &entries[index];
+}
+
+static bool
+resize_glyph_table(struct pixman_renderer *renderer, uint32_t size)
+{
+	struct glyph_entry *entries, *entry;
+	uint32_t index;
+
+	if (!(entries = calloc(size, sizeof entries[0])))
+		return false;
+
+	for (index = 0; index < renderer->glyph_table_size; ++index) {
+		entry = &renderer->glyph_entries[index];
+
+		if (entry->glyph) {
+			*find_glyph_entry(entries, size,
+			                  entry->font_id, entry->glyph) = *entry;
+		}
+	}
+
+	free(renderer->glyph_entries);
+	renderer->glyph_entries = entries;
+	renderer->glyph_table_size = size;
+
+	return true;
+}
+
+static int
+compare_glyph_age(const void *a, const void *b)
+{
+	/* While evicting, last_used holds the age of the glyph. */
+	uint32_t age_a = ((const struct glyph_entry *)a)->last_used,
+	         age_b = ((const struct glyph_entry *)b)->last_used;
+
+	return age_a > age_b ? -1 : age_a < age_b;
+}
+
+/**
+ * Remove the least recently used glyphs from the glyph cache until they take
+ * up at most 3/4 of the maximum size.
+ */
+static void
+evict_glyphs(struct pixman_renderer *renderer)
+{
+	struct glyph_entry *entries, *entry;
+	size_t target_size = renderer->max_glyph_size / 4 * 3;
+	uint32_t index, count = 0;
+
+	if (!(entries = malloc(renderer->num_glyphs * sizeof entries[0])))
+		return;
+
+	for (index = 0; index < renderer->glyph_table_size; ++index) {
+		entry = &renderer->glyph_entries[index];
+
+		if (!entry->glyph)
+			continue;
+
+		entries[count] = *entry;
+		entries[count++].last_used = renderer->clock - entry->last_used;
+	}
+
+	qsort(entries, count, sizeof entries[0], &compare_glyph_age);
+
+	for (index = 0; index < count && renderer->glyph_size > target_size;
+	     ++index) {
+		pixman_glyph_cache_remove(renderer->glyph_cache,
+		                          (void *)(uintptr_t)entries[index].font_id,
+		                          entries[index].glyph);
+		renderer->glyph_size -= entries[index].size;
+	}
+
+	memset(renderer->glyph_entries, 0,
+	       renderer->glyph_table_size * sizeof renderer->glyph_entries[0]);
+	renderer->num_glyphs = count - index;
+
+	for (; index < count; ++index) {
+		entry = find_glyph_entry(renderer->glyph_entries,
+		                         renderer->glyph_table_size,
+		                         entries[index].font_id, entries[index].glyph);
+		*entry = entries[index];
+		entry->last_used = renderer->clock - entries[index].last_used;
+	}
+
+	free(entries);
+}
+
+/**
+ * Start using the glyph cache for a draw. Pixman doesn't remove any glyphs
+ * from the cache until the matching end_glyphs.
+ */
+static void
+begin_glyphs(struct pixman_renderer *renderer)
+{
+	++renderer->clock;
+	pixman_glyph_cache_freeze(renderer->glyph_cache);
+}
+
+static void
+end_glyphs(struct pixman_renderer *renderer)
+{
+	pixman_glyph_cache_thaw(renderer->glyph_cache);
+
+	if (renderer->glyph_size > renderer->max_glyph_size)
+		evict_glyphs(renderer);
+}
+
+/**
+ * Returns the memory used by pixman's copy of a glyph.
+ */
+static uint32_t
+glyph_image_size(struct font *font, struct glyph *glyph)
+{
+	uint32_t stride;
+
+	if (font->mode == FONT_RENDER_GRAY)
+		stride = glyph->pitch;
+	else
+		stride = (glyph->width + 31) / 32 * 4;
+
+	return stride * glyph->height;
+}
+
+/**
+ * Returns the glyph from the renderer's glyph cache, inserting it if it isn't
+ * there yet. This must be called between begin_glyphs and end_glyphs.
+ *
+ * @param glyph_font  The font containing the glyph, which may be a fallback
+ *                    of the font being drawn with
+ */
+static const void *
+cached_glyph(struct pixman_renderer *renderer, struct font *font,
+             struct font *glyph_font, struct glyph *glyph)
+{
+	/* Glyphs are keyed by the font's ID rather than its address, since a
+	 * font may be closed while its glyphs are still in the cache. */
+	void *font_key = (void *)(uintptr_t)font->id;
+	struct glyph_entry *entry;
+	const void *cached;
+	pixman_image_t *image;
+
+	if ((renderer->num_glyphs + 1) * 4 > renderer->glyph_table_size * 3
+	    && !resize_glyph_table(renderer, renderer->glyph_table_size
+	                                     ? renderer->glyph_table_size * 2
+	                                     : 256)) {
+		return NULL;
+	}
+
+	entry = find_glyph_entry(renderer->glyph_entries,
+	                         renderer->glyph_table_size, font->id, glyph);
+
+	if (!entry->glyph) {
+		entry->font_id = font->id;
+		entry->glyph = glyph;
+		entry->size = 0;
+		++renderer->num_glyphs;
+	}
+
+	entry->last_used = renderer->clock;
+
+	if ((cached = pixman_glyph_cache_lookup(renderer->glyph_cache,
+	                                        font_key, glyph))) {
+		return cached;
+	}
+
+	/* Once pixman has a copy of the glyph, the font's bitmap is no longer
+	 * needed, so it is only loaded on a miss. */
+	if (!font_ensure_bitmap(glyph_font, glyph)
+	    || !(image = glyph_image(font, glyph))) {
+		return NULL;
+	}
+
+	cached = pixman_glyph_cache_insert(renderer->glyph_cache, font_key, glyph,
+	                                   -glyph->x, -glyph->y, image);
+
+	/* The glyph cache copies the contents of the glyph bitmap. */
+	pixman_image_unref(image);
+
+	renderer->glyph_size -= entry->size;
+	entry->size = glyph_image_size(font, glyph);
+	renderer->glyph_size += entry->size;
+
+	return cached;
+}
+
+/**
+ * Get the part of the target that may be drawn to, which is within the
+ * extents of the clip.
+ */
+static void
+target_box(struct pixman_renderer *renderer, struct box *box)
+{
+	box->x1 = 0;
+	box->y1 = 0;
+	box->x2 = pixman_image_get_width(renderer->target);
+	box->y2 = pixman_image_get_height(renderer->target);
+
+	if (renderer->base.clipped) {
+		box->x1 = MAX(box->x1, renderer->base.clip.extents.x1);
+		box->y1 = MAX(box->y1, renderer->base.clip.extents.y1);
+		box->x2 = MIN(box->x2, renderer->base.clip.extents.x2);
+		box->y2 = MIN(box->y2, renderer->base.clip.extents.y2);
+	}
+}
+
+/**
+ * Add the glyphs of a run drawn at the given position to the glyph array,
+ * returning the new number of glyphs in it. Glyphs outside the target or its
+ * clip are skipped before their bitmaps are loaded or added to the glyph
+ * cache.
+ */
+static uint32_t
+add_run_glyphs(struct pixman_renderer *renderer, struct font *font,
+               struct text_run *run, int32_t x, int32_t y,
+               pixman_glyph_t *glyphs, uint32_t count)
+{
+	struct box box;
+	uint32_t index, end;
+
+	target_box(renderer, &box);
+
+	if (!text_run_clip(run, x, y, &box, &index, &end))
+		return count;
+
+	for (; index < end; ++index) {
+		glyphs[count].glyph = cached_glyph(renderer, font,
+		                                   run->glyphs[index].font,
+		                                   run->glyphs[index].glyph);
+
+		if (!glyphs[count].glyph)
+			continue;
+
+		glyphs[count].x = x + run->glyphs[index].x;
+		glyphs[count].y = y;
+		++count;
+	}
+
+	return count;
+}
+
+static void
+draw_glyphs(struct pixman_renderer *renderer, pixman_image_t *dst,
+            const struct band_op *op)
+{
+	pixman_composite_glyphs_no_mask(PIXMAN_OP_OVER, op->src, dst, 0, 0, 0, 0,
+	                                renderer->glyph_cache,
+	                                op->count, op->glyphs);
+}
+
+static void
+composite_glyphs(struct pixman_renderer *renderer, uint32_t color,
+                 pixman_glyph_t *glyphs, uint32_t count)
+{
+	struct band_op op = {
+		.draw = &draw_glyphs,
+		.glyphs = glyphs,
+		.count = count,
+	};
+
+	if (count == 0 || !(op.src = solid_image(renderer, color)))
+		return;
+
+	pixman_glyph_get_extents(renderer->glyph_cache, count, glyphs,
+	                         &op.extents);
+	run_op(renderer, &op);
+}
+
+static void
+draw_mask(struct pixman_renderer *renderer, pixman_image_t *dst,
+          const struct band_op *op)
+{
+	pixman_image_composite32(PIXMAN_OP_OVER, op->src, op->mask, dst,
+	                         0, 0, 0, 0, op->x, op->y, op->width, op->height);
+}
+
+void
+renderer_draw_text_scaled(struct wld_renderer *base,
+                          struct font *font, uint32_t color,
+                          int32_t x, int32_t y, float scale,
+                          const char *text, uint32_t length,
+                          struct wld_extents *extents)
+{
+	struct pixman_renderer *renderer = pixman_renderer(base);
+	struct band_op op = { .draw = &draw_mask };
+	pixman_image_t *mask_image;
+	struct text_run *run;
+	struct sdf_mask mask;
+	struct box box;
+	size_t size;
+
+	if (!(run = font_text_run(font, text, length))) {
+		if (extents)
+			extents->advance = 0;
+
+		return;
+	}
+
+	if (extents)
+		extents->advance = run->advance * scale + 0.5f;
+
+	/* The glyphs are scaled and thresholded into a single mask, which is
+	 * composited all at once. Only the part of the mask inside the target
+	 * and its clip is rendered. */
+	target_box(renderer, &box);
+	sdf_measure_run(run, x, y, scale, &box, &mask);
+	size = array_size(mask.height, mask.pitch);
+	reset_scratch(renderer);
+
+	if (size == 0 || !(mask.data = scratch_alloc(renderer, size)))
+		goto error0;
+
+	memset(mask.data, 0, size);
+	sdf_render_run(run, scale, &mask);
+	mask_image = pixman_image_create_bits(PIXMAN_a8, mask.width, mask.height,
+	                                      (uint32_t *)mask.data, mask.pitch);
+
+	if (!mask_image)
+		goto error0;
+
+	if ((op.src = solid_image(renderer, color))) {
+		op.mask = mask_image;
+		op.x = x + mask.x;
+		op.y = y + mask.y;
+		op.width = mask.width;
+		op.height = mask.height;
+		op.extents = (pixman_box32_t){
+			op.x, op.y, op.x + mask.width, op.y + mask.height
+		};
+		run_op(renderer, &op);
+	}
+
+	pixman_image_unref(mask_image);
+error0:
+	text_run_release(run);
+}
+
 void
 renderer_draw_text(struct wld_renderer *base,
                    struct font *font, uint32_t color,
@@ -351,91 +1309,265 @@ renderer_draw_text(struct wld_renderer *base,
                    uint32_t length, struct wld_extents *extents)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
-	int ret;
-	uint32_t c;
-	struct glyph *glyph;
-	FT_UInt glyph_index;
+	struct text_run *run;
 	pixman_glyph_t *glyphs;
-	uint32_t index = 0, origin_x = 0;
-	pixman_color_t pixman_color = PIXMAN_COLOR(color);
-	pixman_image_t *solid;
+	uint32_t count;
 
-	if (length == -1)
-		length = strlen(text);
-	glyphs = malloc(length * sizeof(glyphs[0]));
-	if (!glyphs)
+	if (!(run = font_text_run(font, text, length)))
 		return;
-	solid = pixman_image_create_solid_fill(&pixman_color);
 
-	while ((ret = FcUtf8ToUcs4((FcChar8 *)text, &c, length)) > 0 && c != '\0') {
-		text += ret;
-		length -= ret;
-		glyph_index = FT_Get_Char_Index(font->face, c);
+	reset_scratch(renderer);
+
+	if ((glyphs = scratch_alloc(renderer,
+	                            run->num_glyphs * sizeof glyphs[0]))) {
+		begin_glyphs(renderer);
+		count = add_run_glyphs(renderer, font, run, x, y, glyphs, 0);
+		composite_glyphs(renderer, color, glyphs, count);
+		end_glyphs(renderer);
+	}
+
+	if (extents)
+		extents->advance = run->advance;
+
+	text_run_release(run);
+}
+
+void
+renderer_draw_text_runs(struct wld_renderer *base, struct font *font,
+                        const struct wld_text_run *items, uint32_t num_items)
+{
+	struct pixman_renderer *renderer = pixman_renderer(base);
+	struct text_run **runs;
+	pixman_glyph_t *glyphs;
+	uint32_t index, other, color, count, max_glyphs = 0;
+
+	reset_scratch(renderer);
+
+	if (!(runs = scratch_alloc(renderer, num_items * sizeof runs[0])))
+		return;
+
+	for (index = 0; index < num_items; ++index) {
+		runs[index] = font_text_run(font, items[index].text,
+		                            items[index].length);
+
+		if (runs[index])
+			max_glyphs += runs[index]->num_glyphs;
+	}
+
+	if (!(glyphs = scratch_alloc(renderer, max_glyphs * sizeof glyphs[0])))
+		goto done;
 
-		if (!font_ensure_glyph(font, glyph_index))
+	begin_glyphs(renderer);
+
+	/* Composite the glyphs of all the runs of each color at once. Runs are
+	 * released once their glyphs are added. */
+	for (index = 0; index < num_items; ++index) {
+		if (!runs[index])
 			continue;
 
-		glyph = font->glyphs[glyph_index];
+		color = items[index].color;
+		count = 0;
+
+		for (other = index; other < num_items; ++other) {
+			if (!runs[other] || items[other].color != color)
+				continue;
+
+			count = add_run_glyphs(renderer, font, runs[other],
+			                       items[other].x, items[other].y,
+			                       glyphs, count);
+			text_run_release(runs[other]);
+			runs[other] = NULL;
+		}
+
+		composite_glyphs(renderer, color, glyphs, count);
+	}
+
+	end_glyphs(renderer);
+
+done:
+	for (index = 0; index < num_items; ++index) {
+		if (runs[index])
+			text_run_release(runs[index]);
+	}
+}
+
+/**
+ * Fill the boxes, with one call for each color. The boxes and their colors
+ * are reordered in the process.
+ */
+static void
+fill_boxes_by_color(struct pixman_renderer *renderer, pixman_box32_t *boxes,
+                    uint32_t *colors, uint32_t count)
+{
+	pixman_box32_t box;
+	uint32_t start, index, end, color;
+
+	for (start = 0; start < count; start = end) {
+		color = colors[start];
+
+		/* Move all the boxes of this color to the front. */
+		for (index = end = start + 1; index < count; ++index) {
+			if (colors[index] != color)
+				continue;
+
+			box = boxes[index];
+			boxes[index] = boxes[end];
+			boxes[end] = box;
+			colors[index] = colors[end];
+			colors[end] = color;
+			++end;
+		}
+
+		fill_boxes(renderer, color, &boxes[start], end - start);
+	}
+}
+
+/**
+ * Composite the glyphs, with one call for each color. The glyphs and their
+ * colors are reordered in the process.
+ */
+static void
+composite_glyphs_by_color(struct pixman_renderer *renderer,
+                          pixman_glyph_t *glyphs, uint32_t *colors,
+                          uint32_t count)
+{
+	pixman_glyph_t glyph;
+	uint32_t start, index, end, color;
+
+	for (start = 0; start < count; start = end) {
+		color = colors[start];
+
+		/* Move all the glyphs of this color to the front. */
+		for (index = end = start + 1; index < count; ++index) {
+			if (colors[index] != color)
+				continue;
+
+			glyph = glyphs[index];
+			glyphs[index] = glyphs[end];
+			glyphs[end] = glyph;
+			colors[index] = colors[end];
+			colors[end] = color;
+			++end;
+		}
+
+		composite_glyphs(renderer, color, &glyphs[start], end - start);
+	}
+}
+
+void
+renderer_draw_cells(struct wld_renderer *base, struct font *font,
+                    int32_t x, int32_t y, const struct wld_cell *cells,
+                    uint32_t columns, uint32_t rows)
+{
+	struct pixman_renderer *renderer = pixman_renderer(base);
+	const uint32_t width = font->base.max_advance, height = font->base.height;
+	const struct wld_cell *cell;
+	struct font *glyph_font;
+	struct glyph *glyph;
+	pixman_box32_t *boxes;
+	pixman_glyph_t *glyphs;
+	struct box box;
+	uint32_t *colors;
+	uint32_t row, column, start, color, count;
+	int32_t origin_x, origin_y;
+	size_t num_cells;
+
+	reset_scratch(renderer);
+	num_cells = array_size(columns, rows);
+	boxes = scratch_alloc(renderer, array_size(num_cells, sizeof boxes[0]));
+	glyphs = scratch_alloc(renderer, array_size(num_cells, sizeof glyphs[0]));
+	colors = scratch_alloc(renderer, array_size(num_cells, sizeof colors[0]));
+
+	if (!boxes || !glyphs || !colors)
+		return;
 
-		glyphs[index].x = origin_x;
-		glyphs[index].y = 0;
-		glyphs[index].glyph = pixman_glyph_cache_lookup(renderer->glyph_cache,
-		                                                font, glyph);
+	/* Fill the backgrounds, merging adjacent cells of the same color. */
+	for (row = 0, count = 0; row < rows; ++row) {
+		cell = &cells[row * columns];
 
-		/* If we don't have the glyph in our cache, do some conversions to make
-		 * pixman happy, and then insert it. */
-		if (!glyphs[index].glyph) {
-			uint8_t *src, *dst;
-			uint32_t row, byte_index, bytes_per_row, pitch;
-			pixman_image_t *image;
-			FT_Bitmap *bitmap;
+		for (start = 0; start < columns; start = column) {
+			color = cell_background(&cell[start]);
 
-			bitmap = &glyph->bitmap;
-			image = pixman_image_create_bits(PIXMAN_a1, bitmap->width, bitmap->rows, NULL, bitmap->pitch);
+			for (column = start + 1; column < columns; ++column) {
+				if (cell_background(&cell[column]) != color)
+					break;
+			}
+
+			boxes[count].x1 = x + start * width;
+			boxes[count].y1 = y + row * height;
+			boxes[count].x2 = x + column * width;
+			boxes[count].y2 = y + (row + 1) * height;
+			colors[count++] = color;
+		}
+	}
 
-			if (!image)
-				goto advance;
+	fill_boxes_by_color(renderer, boxes, colors, count);
 
-			pitch = pixman_image_get_stride(image);
-			bytes_per_row = (bitmap->width + 7) / 8;
-			src = bitmap->buffer;
-			dst = (uint8_t *)pixman_image_get_data(image);
+	target_box(renderer, &box);
+	begin_glyphs(renderer);
 
-			for (row = 0; row < bitmap->rows; ++row) {
-				/* Pixman's A1 format expects the bits in the opposite order
-				 * that Freetype gives us. Sigh... */
-				for (byte_index = 0; byte_index < bytes_per_row; ++byte_index)
-					dst[byte_index] = reverse(src[byte_index]);
+	/* Every glyph is at a fixed position in its cell, so there is no need
+	 * to lay out the text. */
+	for (row = 0, count = 0; row < rows; ++row) {
+		cell = &cells[row * columns];
+		origin_y = y + row * height + font->base.ascent;
 
-				dst += pitch;
-				src += bitmap->pitch;
+		for (column = 0; column < columns; ++column) {
+			if (cell[column].character == 0)
+				continue;
+
+			glyph = font_char_glyph(font, cell[column].character,
+			                        &glyph_font);
+			origin_x = x + column * width;
+
+			if (!glyph || !font_glyph_visible(glyph_font, origin_x,
+			                                  origin_y, &box)) {
+				continue;
 			}
 
-			/* Insert the glyph into the cache. */
-			pixman_glyph_cache_freeze(renderer->glyph_cache);
-			glyphs[index].glyph = pixman_glyph_cache_insert(renderer->glyph_cache, font, glyph,
-			                                                -glyph->x, -glyph->y, image);
-			pixman_glyph_cache_thaw(renderer->glyph_cache);
+			glyphs[count].glyph = cached_glyph(renderer, font,
+			                                   glyph_font, glyph);
+
+			if (!glyphs[count].glyph)
+				continue;
 
-			/* The glyph cache copies the contents of the glyph bitmap. */
-			pixman_image_unref(image);
+			glyphs[count].x = origin_x;
+			glyphs[count].y = origin_y;
+			colors[count++] = cell_foreground(&cell[column]);
 		}
+	}
+
+	composite_glyphs_by_color(renderer, glyphs, colors, count);
+	end_glyphs(renderer);
 
-		++index;
+	for (row = 0, count = 0; row < rows; ++row) {
+		cell = &cells[row * columns];
 
-	advance:
-		origin_x += glyph->advance;
+		for (column = 0; column < columns; ++column) {
+			if (!(cell[column].attributes & WLD_CELL_UNDERLINE))
+				continue;
+
+			boxes[count].x1 = x + column * width;
+			boxes[count].y1 = y + row * height + cell_underline_offset(font);
+			boxes[count].x2 = boxes[count].x1 + width;
+			boxes[count].y2 = boxes[count].y1 + 1;
+			colors[count++] = cell_foreground(&cell[column]);
+		}
 	}
 
-	pixman_composite_glyphs_no_mask(PIXMAN_OP_OVER, solid, renderer->target,
-	                                0, 0, x, y, renderer->glyph_cache,
-	                                index, glyphs);
+	fill_boxes_by_color(renderer, boxes, colors, count);
+}
 
-	free(glyphs);
-	pixman_image_unref(solid);
+EXPORT
+void
+wld_pixman_set_glyph_cache_size(struct wld_renderer *base, size_t size)
+{
+	struct pixman_renderer *renderer = pixman_renderer(base);
 
-	if (extents)
-		extents->advance = origin_x;
+	renderer->max_glyph_size = size;
+
+	if (renderer->glyph_size > renderer->max_glyph_size)
+		evict_glyphs(renderer);
 }
 
 void
@@ -447,8 +1579,20 @@ void
 renderer_destroy(struct wld_renderer *base)
 {
 	struct pixman_renderer *renderer = pixman_renderer(base);
+	uint32_t index;
+
+	for (index = 0; index < SOLID_CACHE_SIZE; ++index) {
+		if (renderer->solids[index].image)
+			pixman_image_unref(renderer->solids[index].image);
+	}
 
+	stop_workers(renderer);
+	pthread_mutex_destroy(&renderer->workers.lock);
+	pthread_cond_destroy(&renderer->workers.start);
+	pthread_cond_destroy(&renderer->workers.done);
 	pixman_glyph_cache_destroy(renderer->glyph_cache);
+	free(renderer->glyph_entries);
+	free_scratch(renderer);
 	free(renderer);
 }
 
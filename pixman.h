@@ -24,6 +24,8 @@
 #ifndef WLD_PIXMAN_H
 #define WLD_PIXMAN_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define WLD_PIXMAN_ID (0x01 << 24)
@@ -40,4 +42,31 @@ wld_pixman_create_context()
 	return wld_pixman_context;
 }
 
+struct wld_renderer;
+
+/**
+ * Set the maximum amount of memory, in bytes, used by a pixman renderer to
+ * cache the images of glyphs it has drawn.
+ *
+ * When the images take up more than this, the least recently drawn ones are
+ * removed. The default is 4 MiB.
+ */
+void wld_pixman_set_glyph_cache_size(struct wld_renderer *renderer,
+                                     size_t size);
+
+/**
+ * Set the number of worker threads used by a pixman renderer.
+ *
+ * With worker threads, the target is split into horizontal bands, one for
+ * each worker and one for the calling thread, and large operations are drawn
+ * into all of the bands at once. Each operation is still finished when the
+ * call drawing it returns. The default is 0, which draws everything on the
+ * calling thread.
+ *
+ * @return Whether or not the threads could be started. If not, the renderer
+ *         uses no worker threads.
+ */
+bool wld_pixman_set_threads(struct wld_renderer *renderer,
+                            uint32_t num_threads);
+
 #endif
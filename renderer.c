@@ -57,17 +57,226 @@ default_copy_region(struct wld_renderer *renderer, struct buffer *buffer,
 	}
 }
 
+void
+default_draw_text_runs(struct wld_renderer *renderer, struct font *font,
+                       const struct wld_text_run *runs, uint32_t num_runs)
+{
+	while (num_runs--) {
+		renderer->impl->draw_text(renderer, font, runs->color,
+		                          runs->x, runs->y, runs->text, runs->length,
+		                          NULL);
+		++runs;
+	}
+}
+
+/**
+ * Get the part of the target that may be drawn to, which is within the
+ * extents of the clip.
+ */
+static void
+target_box(struct wld_renderer *renderer, struct box *box)
+{
+	*box = (struct box){ 0 };
+
+	if (!renderer->target)
+		return;
+
+	box->x2 = MIN(renderer->target->width, INT32_MAX);
+	box->y2 = MIN(renderer->target->height, INT32_MAX);
+
+	if (renderer->clipped) {
+		box->x1 = MAX(box->x1, renderer->clip.extents.x1);
+		box->y1 = MAX(box->y1, renderer->clip.extents.y1);
+		box->x2 = MIN(box->x2, renderer->clip.extents.x2);
+		box->y2 = MIN(box->y2, renderer->clip.extents.y2);
+	}
+}
+
+void
+default_draw_text_scaled(struct wld_renderer *renderer, struct font *font,
+                         uint32_t color, int32_t x, int32_t y, float scale,
+                         const char *text, uint32_t length,
+                         struct wld_extents *extents)
+{
+	struct text_run *run;
+	struct sdf_mask mask;
+	struct box box;
+	uint32_t row, column, start;
+	const uint8_t *data;
+
+	if (!(run = font_text_run(font, text, length))) {
+		if (extents)
+			extents->advance = 0;
+
+		return;
+	}
+
+	if (extents)
+		extents->advance = run->advance * scale + 0.5f;
+
+	/* Only the part of the mask inside the target and its clip is
+	 * rendered. */
+	target_box(renderer, &box);
+	sdf_measure_run(run, x, y, scale, &box, &mask);
+
+	if (mask.height == 0 || !(mask.data = calloc(mask.height, mask.pitch)))
+		goto done;
+
+	sdf_render_run(run, scale, &mask);
+
+	/* Fill each span of pixels that are at least half covered. */
+	for (row = 0; row < mask.height; ++row) {
+		data = &mask.data[row * mask.pitch];
+
+		for (column = 0; column < mask.width;) {
+			if (data[column] < 128) {
+				++column;
+				continue;
+			}
+
+			for (start = column; column < mask.width && data[column] >= 128;)
+				++column;
+
+			renderer->impl->fill_rectangle(renderer, color,
+			                               x + mask.x + start, y + mask.y + row,
+			                               column - start, 1);
+		}
+	}
+
+	free(mask.data);
+done:
+	text_run_release(run);
+}
+
+void
+draw_text_runs(struct wld_renderer *renderer, struct font *font,
+               const struct wld_text_run *runs, uint32_t num_runs)
+{
+	if (font->mode != FONT_RENDER_SDF) {
+		renderer->impl->draw_text_runs(renderer, font, runs, num_runs);
+		return;
+	}
+
+	while (num_runs--) {
+		renderer->impl->draw_text_scaled(renderer, font, runs->color,
+		                                 runs->x, runs->y, 1,
+		                                 runs->text, runs->length, NULL);
+		++runs;
+	}
+}
+
+void
+default_draw_cells(struct wld_renderer *renderer, struct font *font,
+                   int32_t x, int32_t y, const struct wld_cell *cells,
+                   uint32_t columns, uint32_t rows)
+{
+	const uint32_t width = font->base.max_advance, height = font->base.height;
+	const struct wld_cell *cell;
+	struct wld_text_run *runs, *run;
+	struct glyph *glyph;
+	const uint32_t underline = cell_underline_offset(font);
+	uint32_t row, column, start, color, size, num_runs = 0;
+	char *text, *end;
+
+	/* Fill the backgrounds, merging adjacent cells of the same color. */
+	for (row = 0; row < rows; ++row) {
+		cell = &cells[row * columns];
+
+		for (start = 0; start < columns; start = column) {
+			color = cell_background(&cell[start]);
+
+			for (column = start + 1; column < columns; ++column) {
+				if (cell_background(&cell[column]) != color)
+					break;
+			}
+
+			renderer->impl->fill_rectangle(renderer, color,
+			                               x + start * width, y + row * height,
+			                               (column - start) * width, height);
+		}
+	}
+
+	runs = malloc(array_size(array_size(columns, rows), sizeof runs[0]));
+	text = malloc(array_size(array_size(columns, rows), 4));
+
+	if (!runs || !text)
+		goto done;
+
+	end = text;
+
+	/* Draw the characters as runs of text, starting a new run whenever the
+	 * color changes or a glyph would not advance by exactly one cell. */
+	for (row = 0; row < rows; ++row) {
+		cell = &cells[row * columns];
+		run = NULL;
+
+		for (column = 0; column < columns; ++column) {
+			if (cell[column].character == 0
+			    || !(size = utf8_encode(cell[column].character, end))) {
+				run = NULL;
+				continue;
+			}
+
+			color = cell_foreground(&cell[column]);
+
+			if (!run || run->color != color) {
+				run = &runs[num_runs++];
+				run->x = x + column * width;
+				run->y = y + row * height + font->base.ascent;
+				run->color = color;
+				run->text = end;
+				run->length = 0;
+			}
+
+			end += size;
+			run->length += size;
+			glyph = font_char_glyph(font, cell[column].character, NULL);
+
+			if (!glyph || glyph->advance != width)
+				run = NULL;
+		}
+	}
+
+	draw_text_runs(renderer, font, runs, num_runs);
+
+	for (row = 0; row < rows; ++row) {
+		cell = &cells[row * columns];
+
+		for (column = 0; column < columns; ++column) {
+			if (!(cell[column].attributes & WLD_CELL_UNDERLINE))
+				continue;
+
+			color = cell_foreground(&cell[column]);
+			renderer->impl->fill_rectangle(renderer, color,
+			                               x + column * width,
+			                               y + row * height + underline,
+			                               width, 1);
+		}
+	}
+
+done:
+	free(runs);
+	free(text);
+}
+
 void
 renderer_initialize(struct wld_renderer *renderer, const struct wld_renderer_impl *impl)
 {
 	*((const struct wld_renderer_impl **)&renderer->impl) = impl;
 	renderer->target = NULL;
+	renderer->display_list = NULL;
+	pixman_region32_init(&renderer->clip);
+	renderer->clipped = false;
 }
 
 EXPORT
 void
 wld_destroy_renderer(struct wld_renderer *renderer)
 {
+	if (renderer->display_list)
+		display_list_destroy(renderer);
+
+	pixman_region32_fini(&renderer->clip);
 	renderer->impl->destroy(renderer);
 }
 
@@ -82,6 +291,10 @@ EXPORT
 bool
 wld_set_target_buffer(struct wld_renderer *renderer, struct wld_buffer *buffer)
 {
+	/* Recorded operations are drawn to the target they were recorded for. */
+	if (renderer->display_list)
+		display_list_execute(renderer);
+
 	if (!renderer->impl->set_target(renderer, (struct buffer *)buffer))
 		return false;
 
@@ -99,7 +312,54 @@ wld_set_target_surface(struct wld_renderer *renderer, struct wld_surface *surfac
 	if (!(back_buffer = surface->impl->back(surface)))
 		return false;
 
-	return renderer->impl->set_target(renderer, back_buffer);
+	if (renderer->display_list)
+		display_list_execute(renderer);
+
+	if (!renderer->impl->set_target(renderer, back_buffer))
+		return false;
+
+	renderer->target = &back_buffer->base;
+
+	return true;
+}
+
+EXPORT
+bool
+wld_set_clip_region(struct wld_renderer *renderer, pixman_region32_t *region)
+{
+	/* Recorded operations are drawn with the clip they were recorded with. */
+	if (renderer->display_list)
+		display_list_execute(renderer);
+
+	if (region && !pixman_region32_copy(&renderer->clip, region))
+		goto error0;
+
+	renderer->clipped = region != NULL;
+
+	if (!renderer->impl->set_clip(renderer, region ? &renderer->clip : NULL))
+		goto error0;
+
+	return true;
+
+error0:
+	renderer->clipped = false;
+	renderer->impl->set_clip(renderer, NULL);
+	return false;
+}
+
+EXPORT
+bool
+wld_set_deferred(struct wld_renderer *renderer, bool deferred)
+{
+	if (deferred && !renderer->display_list)
+		return display_list_create(renderer);
+
+	if (!deferred && renderer->display_list) {
+		display_list_execute(renderer);
+		display_list_destroy(renderer);
+	}
+
+	return deferred;
 }
 
 EXPORT
@@ -107,6 +367,15 @@ void
 wld_fill_rectangle(struct wld_renderer *renderer, uint32_t color,
                    int32_t x, int32_t y, uint32_t width, uint32_t height)
 {
+	pixman_region32_t region;
+
+	if (renderer->display_list) {
+		pixman_region32_init_rect(&region, x, y, width, height);
+		display_list_fill_region(renderer, color, &region);
+		pixman_region32_fini(&region);
+		return;
+	}
+
 	renderer->impl->fill_rectangle(renderer, color, x, y, width, height);
 }
 
@@ -114,7 +383,10 @@ EXPORT
 void
 wld_fill_region(struct wld_renderer *renderer, uint32_t color, pixman_region32_t *region)
 {
-	renderer->impl->fill_region(renderer, color, region);
+	if (renderer->display_list)
+		display_list_fill_region(renderer, color, region);
+	else
+		renderer->impl->fill_region(renderer, color, region);
 }
 
 EXPORT
@@ -125,6 +397,16 @@ wld_copy_rectangle(struct wld_renderer *renderer,
                    int32_t src_x, int32_t src_y,
                    uint32_t width, uint32_t height)
 {
+	pixman_region32_t region;
+
+	if (renderer->display_list) {
+		pixman_region32_init_rect(&region, src_x, src_y, width, height);
+		display_list_copy_region(renderer, (struct buffer *)buffer,
+		                         dst_x - src_x, dst_y - src_y, &region);
+		pixman_region32_fini(&region);
+		return;
+	}
+
 	renderer->impl->copy_rectangle(renderer, (struct buffer *)buffer,
 	                               dst_x, dst_y, src_x, src_y, width, height);
 }
@@ -135,8 +417,25 @@ wld_copy_region(struct wld_renderer *renderer,
                 struct wld_buffer *buffer,
                 int32_t dst_x, int32_t dst_y, pixman_region32_t *region)
 {
-	renderer->impl->copy_region(renderer, (struct buffer *)buffer,
-	                            dst_x, dst_y, region);
+	if (renderer->display_list) {
+		display_list_copy_region(renderer, (struct buffer *)buffer,
+		                         dst_x, dst_y, region);
+	} else {
+		renderer->impl->copy_region(renderer, (struct buffer *)buffer,
+		                            dst_x, dst_y, region);
+	}
+}
+
+/**
+ * Get the font to draw text with, which for renderers that can only draw
+ * monochrome glyphs is the monochrome version of an anti-aliased font.
+ */
+static struct font *
+draw_font(struct wld_renderer *renderer, struct wld_font *font_base)
+{
+	struct font *font = (void *)font_base;
+
+	return renderer->impl->monochrome_text ? font_monochrome(font) : font;
 }
 
 EXPORT
@@ -145,17 +444,105 @@ wld_draw_text(struct wld_renderer *renderer,
               struct wld_font *font_base, uint32_t color,
               int32_t x, int32_t y, const char *text, uint32_t length,
               struct wld_extents *extents)
+{
+	struct font *font = draw_font(renderer, font_base);
+
+	if (renderer->display_list) {
+		display_list_draw_text(renderer, font, color, x, y, 1,
+		                       text, length, extents);
+		return;
+	}
+
+	font_begin_draw(font);
+
+	if (font->mode == FONT_RENDER_SDF) {
+		renderer->impl->draw_text_scaled(renderer, font, color, x, y, 1,
+		                                 text, length, extents);
+	} else {
+		renderer->impl->draw_text(renderer, font, color, x, y, text, length,
+		                          extents);
+	}
+
+	font_end_draw(font);
+}
+
+EXPORT
+void
+wld_draw_text_scaled(struct wld_renderer *renderer,
+                     struct wld_font *font_base, uint32_t color,
+                     int32_t x, int32_t y, float scale,
+                     const char *text, uint32_t length,
+                     struct wld_extents *extents)
 {
 	struct font *font = (void *)font_base;
 
-	renderer->impl->draw_text(renderer, font, color, x, y, text, length,
-	                          extents);
+	if (font->mode != FONT_RENDER_SDF) {
+		wld_draw_text(renderer, font_base, color, x, y, text, length,
+		              extents);
+		return;
+	}
+
+	if (renderer->display_list) {
+		display_list_draw_text(renderer, font, color, x, y, scale,
+		                       text, length, extents);
+		return;
+	}
+
+	font_begin_draw(font);
+	renderer->impl->draw_text_scaled(renderer, font, color, x, y, scale,
+	                                 text, length, extents);
+	font_end_draw(font);
+}
+
+EXPORT
+void
+wld_draw_text_runs(struct wld_renderer *renderer, struct wld_font *font_base,
+                   const struct wld_text_run *runs, uint32_t num_runs)
+{
+	struct font *font = draw_font(renderer, font_base);
+
+	if (renderer->display_list) {
+		display_list_draw_text_runs(renderer, font, runs, num_runs);
+		return;
+	}
+
+	font_begin_draw(font);
+	draw_text_runs(renderer, font, runs, num_runs);
+	font_end_draw(font);
+}
+
+EXPORT
+void
+wld_draw_cells(struct wld_renderer *renderer, struct wld_font *font_base,
+               int32_t x, int32_t y, const struct wld_cell *cells,
+               uint32_t columns, uint32_t rows)
+{
+	struct font *font = draw_font(renderer, font_base);
+
+	if (renderer->display_list) {
+		display_list_draw_cells(renderer, font, x, y, cells, columns, rows);
+		return;
+	}
+
+	font_begin_draw(font);
+
+	/* The default draws the glyphs of SDF fonts with draw_text_scaled. */
+	if (font->mode == FONT_RENDER_SDF)
+		default_draw_cells(renderer, font, x, y, cells, columns, rows);
+	else
+		renderer->impl->draw_cells(renderer, font, x, y, cells, columns, rows);
+
+	font_end_draw(font);
 }
 
 EXPORT
 void
 wld_flush(struct wld_renderer *renderer)
 {
+	if (renderer->display_list)
+		display_list_execute(renderer);
+
 	renderer->impl->flush(renderer);
 	renderer->impl->set_target(renderer, NULL);
+	renderer->target = NULL;
 }
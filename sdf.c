@@ -0,0 +1,224 @@
+/* wld: sdf.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+/* Avoid depending on libm just for floorf and ceilf. Values outside the range
+ * of int32_t, from very large scales, are clamped to it. */
+static inline int32_t
+floor_int(float value)
+{
+	int32_t result;
+
+	if (value <= INT32_MIN)
+		return INT32_MIN;
+	if (value >= INT32_MAX)
+		return INT32_MAX;
+
+	result = value;
+
+	return result > value ? result - 1 : result;
+}
+
+static inline int32_t
+ceil_int(float value)
+{
+	int32_t result;
+
+	if (value <= INT32_MIN)
+		return INT32_MIN;
+	if (value >= INT32_MAX)
+		return INT32_MAX;
+
+	result = value;
+
+	return result < value ? result + 1 : result;
+}
+
+static inline float
+texel(const struct glyph *glyph, int32_t x, int32_t y)
+{
+	/* Everything outside the field is as far from the outline as the field
+	 * can represent. */
+	if (x < 0 || y < 0 || x >= glyph->width || y >= glyph->height)
+		return 0;
+
+	return glyph->bitmap[y * glyph->pitch + x];
+}
+
+/**
+ * Sample the distance field at the given position, in pixels of the field,
+ * with bilinear filtering.
+ */
+static float
+sample(const struct glyph *glyph, float u, float v)
+{
+	int32_t x = floor_int(u), y = floor_int(v);
+	float fx = u - x, fy = v - y, top, bottom;
+
+	top = texel(glyph, x, y)
+	      + (texel(glyph, x + 1, y) - texel(glyph, x, y)) * fx;
+	bottom = texel(glyph, x, y + 1)
+	         + (texel(glyph, x + 1, y + 1) - texel(glyph, x, y + 1)) * fx;
+
+	return top + (bottom - top) * fy;
+}
+
+/**
+ * Render a glyph whose field starts at (x, y) in the mask.
+ */
+static void
+render_glyph(struct sdf_mask *mask, const struct glyph *glyph,
+             float x, float y, float scale)
+{
+	const float inverse = 1 / scale;
+
+	/* Converts field values to signed distances in mask pixels. */
+	const float factor = (float)FONT_SDF_SPREAD / 128 * scale;
+	int32_t row, column, left, right, top, bottom;
+	float u, v, coverage;
+	uint8_t *dst, value;
+
+	/* The mask is clipped to the part of the run that may be visible, so
+	 * only part of the glyph may be inside it. */
+	left = MAX(floor_int(x), 0);
+	top = MAX(floor_int(y), 0);
+	right = MIN(ceil_int(x + glyph->width * scale), (int32_t)mask->width);
+	bottom = MIN(ceil_int(y + glyph->height * scale), (int32_t)mask->height);
+
+	for (row = top; row < bottom; ++row) {
+		v = (row + 0.5f - y) * inverse - 0.5f;
+		dst = &mask->data[row * mask->pitch + left];
+
+		for (column = left; column < right; ++column, ++dst) {
+			u = (column + 0.5f - x) * inverse - 0.5f;
+
+			/* The threshold: pixels whose centers are on the outline
+			 * are half covered, and coverage ramps over one pixel. */
+			coverage = (sample(glyph, u, v) - 128) * factor + 0.5f;
+
+			if (coverage <= 0)
+				continue;
+
+			value = coverage >= 1 ? 255 : coverage * 255 + 0.5f;
+
+			/* Glyphs may overlap, so keep the greatest coverage. */
+			if (value > *dst)
+				*dst = value;
+		}
+	}
+}
+
+void
+sdf_measure_run(struct text_run *run, int32_t x, int32_t y, float scale,
+                const struct box *box, struct sdf_mask *mask)
+{
+	struct text_run_glyph *run_glyph;
+	struct glyph *glyph;
+	struct box run_box;
+	int64_t left = INT64_MAX, top = INT64_MAX,
+	        right = INT64_MIN, bottom = INT64_MIN;
+	uint32_t index;
+	float glyph_x, glyph_y;
+
+	mask->data = NULL;
+
+	if (!(scale > 0))
+		goto empty;
+
+	/* The run is scaled about its origin, so the glyphs which may be
+	 * visible are those inside the box scaled down by the same amount. */
+	run_box.x1 = floor_int(((float)box->x1 - x) / scale);
+	run_box.y1 = floor_int(((float)box->y1 - y) / scale);
+	run_box.x2 = ceil_int(((float)box->x2 - x) / scale);
+	run_box.y2 = ceil_int(((float)box->y2 - y) / scale);
+
+	/* Keep the arithmetic in text_run_clip from overflowing. */
+	run_box.x1 = MAX(run_box.x1, INT32_MIN / 2);
+	run_box.y1 = MAX(run_box.y1, INT32_MIN / 2);
+	run_box.x2 = MIN(run_box.x2, INT32_MAX / 2);
+	run_box.y2 = MIN(run_box.y2, INT32_MAX / 2);
+
+	if (!text_run_clip(run, 0, 0, &run_box, &mask->start, &mask->end))
+		goto empty;
+
+	for (index = mask->start; index < mask->end; ++index) {
+		run_glyph = &run->glyphs[index];
+		glyph = run_glyph->glyph;
+
+		if (!font_ensure_bitmap(run_glyph->font, glyph)
+		    || glyph->width == 0 || glyph->height == 0) {
+			continue;
+		}
+
+		glyph_x = (run_glyph->x + glyph->x) * scale;
+		glyph_y = glyph->y * scale;
+		left = MIN(left, floor_int(glyph_x));
+		top = MIN(top, floor_int(glyph_y));
+		right = MAX(right, ceil_int(glyph_x + glyph->width * scale));
+		bottom = MAX(bottom, ceil_int(glyph_y + glyph->height * scale));
+	}
+
+	/* Only the part of the mask inside the box is rendered. */
+	left = MAX(left, (int64_t)box->x1 - x);
+	top = MAX(top, (int64_t)box->y1 - y);
+	right = MIN(right, (int64_t)box->x2 - x);
+	bottom = MIN(bottom, (int64_t)box->y2 - y);
+
+	if (left >= right || top >= bottom)
+		goto empty;
+
+	mask->x = left;
+	mask->y = top;
+	mask->width = right - left;
+	mask->height = bottom - top;
+	mask->pitch = (mask->width + 3) & ~3;
+
+	return;
+
+empty:
+	mask->start = mask->end = 0;
+	mask->x = mask->y = 0;
+	mask->width = mask->height = mask->pitch = 0;
+}
+
+void
+sdf_render_run(struct text_run *run, float scale, struct sdf_mask *mask)
+{
+	struct text_run_glyph *run_glyph;
+	struct glyph *glyph;
+	uint32_t index;
+
+	for (index = mask->start; index < mask->end; ++index) {
+		run_glyph = &run->glyphs[index];
+		glyph = run_glyph->glyph;
+
+		if (!__atomic_load_n(&glyph->bitmap_loaded, __ATOMIC_ACQUIRE)
+		    || glyph->width == 0 || glyph->height == 0) {
+			continue;
+		}
+
+		render_glyph(mask, glyph, (run_glyph->x + glyph->x) * scale - mask->x,
+		             glyph->y * scale - mask->y, scale);
+	}
+}
@@ -0,0 +1,444 @@
+/* wld: text_run.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+static inline size_t
+run_size(struct text_run *run)
+{
+	return sizeof *run + run->num_glyphs * sizeof run->glyphs[0] + run->length;
+}
+
+static inline struct text_run_cache_shard *
+run_shard(struct text_run_cache *cache, uint64_t hash)
+{
+	/* The low bits of the hash pick the bucket within the shard. */
+	return &cache->shards[(hash >> 32) % TEXT_RUN_CACHE_SHARDS];
+}
+
+static inline void
+unref_run(struct text_run *run)
+{
+	if (__atomic_sub_fetch(&run->ref, 1, __ATOMIC_ACQ_REL) == 0)
+		free(run);
+}
+
+void
+text_run_cache_initialize(struct text_run_cache *cache)
+{
+	struct text_run_cache_shard *shard;
+	uint32_t index;
+
+	for (index = 0; index < TEXT_RUN_CACHE_SHARDS; ++index) {
+		shard = &cache->shards[index];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->buckets = NULL;
+		shard->num_buckets = 0;
+		shard->count = 0;
+		shard->newest = NULL;
+		shard->oldest = NULL;
+		shard->size = 0;
+		shard->max_size = TEXT_RUN_CACHE_DEFAULT_SIZE / TEXT_RUN_CACHE_SHARDS;
+		shard->hits = 0;
+		shard->misses = 0;
+	}
+}
+
+/**
+ * Remove a run from its shard, dropping the shard's reference to it. The
+ * shard lock must be held.
+ */
+static void
+remove_run(struct text_run_cache_shard *shard, struct text_run *run)
+{
+	struct text_run **link;
+
+	link = &shard->buckets[run->hash & (shard->num_buckets - 1)];
+
+	while (*link != run)
+		link = &(*link)->next;
+
+	*link = run->next;
+
+	if (run->newer)
+		run->newer->older = run->older;
+	else
+		shard->newest = run->older;
+
+	if (run->older)
+		run->older->newer = run->newer;
+	else
+		shard->oldest = run->newer;
+
+	shard->size -= run_size(run);
+	--shard->count;
+	unref_run(run);
+}
+
+static void
+evict_runs(struct text_run_cache_shard *shard)
+{
+	while (shard->size > shard->max_size)
+		remove_run(shard, shard->oldest);
+}
+
+void
+text_run_cache_finalize(struct text_run_cache *cache)
+{
+	struct text_run_cache_shard *shard;
+	uint32_t index;
+
+	for (index = 0; index < TEXT_RUN_CACHE_SHARDS; ++index) {
+		shard = &cache->shards[index];
+
+		while (shard->oldest)
+			remove_run(shard, shard->oldest);
+
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
+
+void
+text_run_cache_remove_font(struct text_run_cache *cache, struct font *font)
+{
+	struct text_run_cache_shard *shard;
+	struct text_run *run, *older;
+	uint32_t index;
+
+	for (index = 0; index < TEXT_RUN_CACHE_SHARDS; ++index) {
+		shard = &cache->shards[index];
+		pthread_mutex_lock(&shard->lock);
+
+		for (run = shard->newest; run; run = older) {
+			older = run->older;
+
+			if (run->font == font)
+				remove_run(shard, run);
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+static bool
+grow_buckets(struct text_run_cache_shard *shard)
+{
+	struct text_run **buckets, *run, *next;
+	uint32_t num_buckets, index;
+
+	num_buckets = shard->num_buckets ? shard->num_buckets * 2 : 16;
+
+	if (!(buckets = calloc(num_buckets, sizeof buckets[0])))
+		return false;
+
+	for (index = 0; index < shard->num_buckets; ++index) {
+		for (run = shard->buckets[index]; run; run = next) {
+			next = run->next;
+			run->next = buckets[run->hash & (num_buckets - 1)];
+			buckets[run->hash & (num_buckets - 1)] = run;
+		}
+	}
+
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->num_buckets = num_buckets;
+
+	return true;
+}
+
+/**
+ * Find a run in a shard, and mark it as the most recently used. The shard
+ * lock must be held.
+ */
+static struct text_run *
+find_run(struct text_run_cache_shard *shard, struct font *font, uint64_t hash,
+         const char *text, uint32_t length)
+{
+	struct text_run *run;
+
+	if (shard->num_buckets == 0)
+		return NULL;
+
+	for (run = shard->buckets[hash & (shard->num_buckets - 1)]; run;
+	     run = run->next) {
+		if (run->hash == hash && run->font == font && run->length == length
+		    && memcmp(run->text, text, length) == 0) {
+			break;
+		}
+	}
+
+	if (!run || !run->newer)
+		return run;
+
+	run->newer->older = run->older;
+
+	if (run->older)
+		run->older->newer = run->newer;
+	else
+		shard->oldest = run->newer;
+
+	run->newer = NULL;
+	run->older = shard->newest;
+	shard->newest->newer = run;
+	shard->newest = run;
+
+	return run;
+}
+
+/**
+ * Add a run to a shard as the most recently used, taking a reference to it.
+ * The shard lock must be held.
+ */
+static void
+insert_run(struct text_run_cache_shard *shard, struct text_run *run)
+{
+	struct text_run **bucket;
+
+	if (run_size(run) > shard->max_size
+	    || (shard->count >= shard->num_buckets && !grow_buckets(shard))) {
+		return;
+	}
+
+	bucket = &shard->buckets[run->hash & (shard->num_buckets - 1)];
+	run->next = *bucket;
+	*bucket = run;
+
+	run->newer = NULL;
+	run->older = shard->newest;
+
+	if (shard->newest)
+		shard->newest->newer = run;
+	else
+		shard->oldest = run;
+
+	shard->newest = run;
+	shard->size += run_size(run);
+	++shard->count;
+	__atomic_add_fetch(&run->ref, 1, __ATOMIC_RELAXED);
+
+	evict_runs(shard);
+}
+
+static inline void
+add_glyph(struct text_run *run, struct font *font, uint32_t character,
+          int32_t *origin_x)
+{
+	struct glyph *glyph;
+
+	if (!(glyph = font_char_glyph(font, character, &font)))
+		return;
+
+	run->glyphs[run->num_glyphs].glyph = glyph;
+	run->glyphs[run->num_glyphs].font = font;
+	run->glyphs[run->num_glyphs].x = *origin_x;
+	++run->num_glyphs;
+	*origin_x += glyph->advance;
+
+	if (font != run->font) {
+		run->bounds.x1 = MIN(run->bounds.x1, font->bounds.x1);
+		run->bounds.y1 = MIN(run->bounds.y1, font->bounds.y1);
+		run->bounds.x2 = MAX(run->bounds.x2, font->bounds.x2);
+		run->bounds.y2 = MAX(run->bounds.y2, font->bounds.y2);
+	}
+}
+
+static struct text_run *
+layout_run(struct font *font, const char *text, uint32_t length)
+{
+	struct text_run *run, *shrunk;
+	uint32_t c, offset = 0, ascii_end, size;
+	int32_t origin_x = 0;
+
+	/* Each character takes at least one byte, so this is enough space for
+	 * the glyphs and a copy of the text. */
+	run = malloc(sizeof *run + length * (sizeof run->glyphs[0] + 1));
+
+	if (!run)
+		return NULL;
+
+	run->font = font;
+	run->bounds = font->bounds;
+	run->num_glyphs = 0;
+
+	while (offset < length) {
+		/* ASCII characters need no decoding, so handle them directly. */
+		ascii_end = offset + utf8_ascii_length(text + offset, length - offset);
+
+		for (; offset < ascii_end; ++offset)
+			add_glyph(run, font, (uint8_t)text[offset], &origin_x);
+
+		if (offset == length)
+			break;
+
+		/* Stop at the first invalid sequence. */
+		if (!(size = utf8_decode(text + offset, length - offset, &c)))
+			break;
+
+		add_glyph(run, font, c, &origin_x);
+		offset += size;
+	}
+
+	run->length = length;
+	run->advance = origin_x;
+	memcpy(&run->glyphs[run->num_glyphs], text, length);
+
+	if ((shrunk = realloc(run, run_size(run))))
+		run = shrunk;
+
+	run->text = (const char *)&run->glyphs[run->num_glyphs];
+
+	return run;
+}
+
+struct text_run *
+font_text_run(struct font *font, const char *text, uint32_t length)
+{
+	struct text_run_cache_shard *shard;
+	struct text_run *run, *cached_run;
+	uint64_t hash;
+
+	length = strnlen(text, length);
+	hash = hash_bytes(HASH_INITIAL, &font, sizeof font);
+	hash = hash_bytes(hash, text, length);
+	shard = run_shard(&font->context->run_cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	if ((run = find_run(shard, font, hash, text, length))) {
+		__atomic_add_fetch(&run->ref, 1, __ATOMIC_RELAXED);
+		++shard->hits;
+		pthread_mutex_unlock(&shard->lock);
+
+		return run;
+	}
+
+	++shard->misses;
+	pthread_mutex_unlock(&shard->lock);
+
+	/* Lay out the run without the shard lock, since it may need to load
+	 * glyphs. */
+	if (!(run = layout_run(font, text, length)))
+		return NULL;
+
+	run->hash = hash;
+	run->ref = 1;
+
+	pthread_mutex_lock(&shard->lock);
+
+	/* Another thread may have added the same run in the meantime. */
+	if ((cached_run = find_run(shard, font, hash, text, length))) {
+		__atomic_add_fetch(&cached_run->ref, 1, __ATOMIC_RELAXED);
+		free(run);
+		run = cached_run;
+	} else
+		insert_run(shard, run);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return run;
+}
+
+void
+text_run_release(struct text_run *run)
+{
+	/* The cache holds its own reference to the runs in it, so the last
+	 * reference is always the one to free the run. */
+	unref_run(run);
+}
+
+/**
+ * Returns the index of the first glyph from start on whose origin is past the
+ * given offset.
+ */
+static uint32_t
+first_glyph_past(struct text_run *run, uint32_t start, int32_t offset)
+{
+	uint32_t end = run->num_glyphs, middle;
+
+	while (start < end) {
+		middle = start + (end - start) / 2;
+
+		if (run->glyphs[middle].x > offset)
+			end = middle;
+		else
+			start = middle + 1;
+	}
+
+	return start;
+}
+
+bool
+text_run_clip(struct text_run *run, int32_t x, int32_t y,
+              const struct box *box, uint32_t *start, uint32_t *end)
+{
+	if (y + run->bounds.y2 <= box->y1 || y + run->bounds.y1 >= box->y2)
+		return false;
+
+	/* Glyph origins never decrease along a run, so the glyphs which may be
+	 * visible are a contiguous range. */
+	*start = first_glyph_past(run, 0, box->x1 - x - run->bounds.x2);
+	*end = first_glyph_past(run, *start, box->x2 - x - run->bounds.x1 - 1);
+
+	return *start < *end;
+}
+
+EXPORT
+void
+wld_font_set_run_cache_size(struct wld_font_context *context, size_t size)
+{
+	struct text_run_cache_shard *shard;
+	uint32_t index;
+
+	for (index = 0; index < TEXT_RUN_CACHE_SHARDS; ++index) {
+		shard = &context->run_cache.shards[index];
+		pthread_mutex_lock(&shard->lock);
+		shard->max_size = size / TEXT_RUN_CACHE_SHARDS;
+		evict_runs(shard);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+EXPORT
+void
+wld_font_get_run_cache_statistics(struct wld_font_context *context,
+                                  struct wld_run_cache_statistics *stats)
+{
+	struct text_run_cache_shard *shard;
+	uint32_t index;
+
+	stats->hits = 0;
+	stats->misses = 0;
+	stats->count = 0;
+	stats->size = 0;
+
+	for (index = 0; index < TEXT_RUN_CACHE_SHARDS; ++index) {
+		shard = &context->run_cache.shards[index];
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->count += shard->count;
+		stats->size += shard->size;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,160 @@
+/* wld: utf8.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+uint32_t
+utf8_ascii_length(const char *text, uint32_t length)
+{
+	const uint8_t *start = (const uint8_t *)text, *byte = start,
+	              *end = start + length;
+
+	/* Scan for the first byte with its high bit set, a block at a time. */
+#if defined(__AVX2__)
+	for (; end - byte >= 32; byte += 32) {
+		uint32_t mask = _mm256_movemask_epi8(_mm256_loadu_si256((const void *)byte));
+
+		if (mask != 0)
+			return byte - start + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; end - byte >= 16; byte += 16) {
+		uint32_t mask = _mm_movemask_epi8(_mm_loadu_si128((const void *)byte));
+
+		if (mask != 0)
+			return byte - start + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; end - byte >= 16; byte += 16) {
+		if (vmaxvq_u8(vld1q_u8(byte)) >= 0x80)
+			break;
+	}
+#else
+	uint64_t word;
+
+	for (; end - byte >= 8; byte += 8) {
+		memcpy(&word, byte, sizeof word);
+
+		if (word & 0x8080808080808080)
+			break;
+	}
+#endif
+
+	while (byte < end && *byte < 0x80)
+		++byte;
+
+	return byte - start;
+}
+
+uint32_t
+utf8_decode(const char *text, uint32_t length, uint32_t *character)
+{
+	static const uint32_t minimum[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	const uint8_t *byte = (const uint8_t *)text;
+	uint32_t c, size, index;
+
+	if (length == 0)
+		return 0;
+
+	if (byte[0] < 0x80) {
+		*character = byte[0];
+		return 1;
+	}
+
+	/* 0x80 to 0xbf are continuation bytes, 0xc0 and 0xc1 only begin
+	 * overlong encodings, and sequences beginning with 0xf5 or higher are
+	 * past U+10FFFF. */
+	if (byte[0] < 0xc2) {
+		return 0;
+	} else if (byte[0] < 0xe0) {
+		size = 2;
+		c = byte[0] & 0x1f;
+	} else if (byte[0] < 0xf0) {
+		size = 3;
+		c = byte[0] & 0x0f;
+	} else if (byte[0] < 0xf5) {
+		size = 4;
+		c = byte[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (length < size)
+		return 0;
+
+	for (index = 1; index < size; ++index) {
+		if ((byte[index] & 0xc0) != 0x80)
+			return 0;
+
+		c = c << 6 | (byte[index] & 0x3f);
+	}
+
+	if (c < minimum[size] || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+		return 0;
+
+	*character = c;
+
+	return size;
+}
+
+uint32_t
+utf8_encode(uint32_t character, char *text)
+{
+	uint8_t *byte = (uint8_t *)text;
+
+	if (character < 0x80) {
+		byte[0] = character;
+		return 1;
+	} else if (character < 0x800) {
+		byte[0] = 0xc0 | character >> 6;
+		byte[1] = 0x80 | (character & 0x3f);
+		return 2;
+	} else if (character < 0x10000) {
+		if (character >= 0xd800 && character <= 0xdfff)
+			return 0;
+
+		byte[0] = 0xe0 | character >> 12;
+		byte[1] = 0x80 | (character >> 6 & 0x3f);
+		byte[2] = 0x80 | (character & 0x3f);
+		return 3;
+	} else if (character <= 0x10ffff) {
+		byte[0] = 0xf0 | character >> 18;
+		byte[1] = 0x80 | (character >> 12 & 0x3f);
+		byte[2] = 0x80 | (character >> 6 & 0x3f);
+		byte[3] = 0x80 | (character & 0x3f);
+		return 4;
+	}
+
+	return 0;
+}
@@ -28,12 +28,27 @@
 
 #include <assert.h>
 #include <ft2build.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include FT_FREETYPE_H
 #include FT_BITMAP_H
 
 #define ARRAY_LENGTH(array) (sizeof(array) / sizeof(array)[0])
+#define HASH_INITIAL 0xcbf29ce484222325
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define GLYPH_PAGE_SHIFT 8
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_SHIFT)
+#define CHAR_CACHE_DIRECT_SIZE 0x800
+#define CHAR_SLOT_SHIFT 24
+#define FONT_MAX_FALLBACKS 255
+#define FONT_NAME_CACHE_SIZE 64
+#define GLYPH_ATLAS_PAGE_SIZE (64 * 1024)
+#define FONT_SDF_SPREAD 8
+#define TEXT_RUN_CACHE_DEFAULT_SIZE (1024 * 1024)
+#define TEXT_RUN_CACHE_SHARDS 16
 #if ENABLE_DEBUG
 #define DEBUG(format, ...) \
 	fprintf(stderr, "# %s: " format, __func__, ##__VA_ARGS__)
@@ -41,6 +56,10 @@
 #define DEBUG(format, ...)
 #endif
 
+#if FREETYPE_MAJOR > 2 || (FREETYPE_MAJOR == 2 && FREETYPE_MINOR >= 11)
+#define HAVE_FT_SDF 1
+#endif
+
 #define EXPORT __attribute__((visibility("default")))
 #define CONTAINER_OF(ptr, type, member) \
 	((type *)((uintptr_t)ptr - offsetof(type, member)))
@@ -51,12 +70,225 @@
 		return (struct impl_type *)object;                          \
 	}
 
+/**
+ * Returns the size of an array of count elements of the given size, or
+ * SIZE_MAX, which no allocation can satisfy, if it would overflow.
+ */
+static inline size_t
+array_size(size_t count, size_t size)
+{
+	return size != 0 && count > SIZE_MAX / size ? SIZE_MAX : count * size;
+}
+
+/**
+ * A rectangle, from (x1, y1) up to but not including (x2, y2).
+ */
+struct box {
+	int32_t x1, y1, x2, y2;
+};
+
+struct text_run_glyph {
+	struct glyph *glyph;
+
+	/**
+	 * The font containing the glyph, which is either the run's font or one
+	 * of its fallbacks.
+	 */
+	struct font *font;
+
+	/**
+	 * The offset of the glyph's origin from the start of the run.
+	 */
+	int32_t x;
+};
+
+/**
+ * The glyphs for a string, along with their positions.
+ */
+struct text_run {
+	struct font *font;
+	uint64_t hash;
+	const char *text;
+	uint32_t length;
+	uint32_t advance;
+
+	/**
+	 * The union of the ink bounds of the fonts of the run's glyphs, relative
+	 * to each glyph's origin.
+	 */
+	struct box bounds;
+
+	/**
+	 * The number of references to the run, including one held by the run
+	 * cache while the run is in it. Updated atomically.
+	 */
+	unsigned ref;
+
+	struct text_run *next;
+	struct text_run *newer, *older;
+
+	uint32_t num_glyphs;
+	struct text_run_glyph glyphs[];
+};
+
+/**
+ * Part of the run cache, holding the runs whose hashes select it. Each shard
+ * has its own lock, so threads looking up different strings rarely wait for
+ * each other, and its own share of the cache's size.
+ */
+struct text_run_cache_shard {
+	pthread_mutex_t lock;
+
+	/**
+	 * A hash table of the runs, chained through their next pointers.
+	 */
+	struct text_run **buckets;
+	uint32_t num_buckets, count;
+
+	/**
+	 * The runs, from most to least recently used.
+	 */
+	struct text_run *newest, *oldest;
+
+	size_t size, max_size;
+	uint64_t hits, misses;
+};
+
+/**
+ * A cache of recently laid out runs, so that strings which are drawn every
+ * frame don't need to be decoded and looked up again each time.
+ */
+struct text_run_cache {
+	struct text_run_cache_shard shards[TEXT_RUN_CACHE_SHARDS];
+};
+
+/**
+ * The result of resolving a font name with fontconfig.
+ */
+struct font_name {
+	char *name;
+
+	/**
+	 * The substituted pattern, the fonts fontconfig considers suitable for
+	 * it, in order of preference, and the pattern to open the best of them.
+	 */
+	FcPattern *pattern;
+	FcFontSet *set;
+	FcPattern *match;
+
+	/**
+	 * The number of users of the name, and whether or not it is still in
+	 * the name cache. Protected by the context lock.
+	 */
+	unsigned ref;
+	bool cached;
+
+	struct font_name *next;
+};
+
+/**
+ * A cache of recently resolved font names, from most to least recently used.
+ * Since the results depend on the fontconfig configuration, the cache is
+ * cleared when it changes.
+ */
+struct font_name_cache {
+	struct font_name *names;
+	uint32_t count;
+	FcConfig *config;
+	time_t checked;
+};
+
 struct wld_font_context {
 	FT_Library library;
+
+	/**
+	 * Protects the creation and destruction of faces, which FreeType does
+	 * not allow concurrently on the same library, along with the lists of
+	 * open faces and fonts.
+	 */
+	pthread_mutex_t lock;
+	char *cache_directory;
+	struct text_run_cache run_cache;
+
+	/**
+	 * The faces opened from font files, shared by all the fonts using the
+	 * same file and face index.
+	 */
+	struct font_face *faces;
+
+	/**
+	 * The open fonts which may be shared by later calls to
+	 * wld_font_open_pattern or wld_font_open_name.
+	 */
+	struct font *fonts;
+
+	struct font_name_cache name_cache;
+
+	/**
+	 * The number of fonts still being opened by wld_font_open_name_async,
+	 * which must finish before the context is destroyed.
+	 */
+	uint32_t pending;
+	pthread_cond_t idle;
+};
+
+/**
+ * A FreeType face shared by fonts of different sizes or render modes. Each
+ * font has its own FT_Size, which is activated while the face lock is held.
+ */
+struct font_face {
+	FT_Face face;
+
+	/**
+	 * The font file and face index, or NULL for a face from FC_FT_FACE,
+	 * which is not shared.
+	 */
+	char *filename;
+	int index;
+	uint32_t ref;
+
+	/**
+	 * The font file, mapped read-only for the lifetime of the face, so that
+	 * processes using the same font share its pages.
+	 */
+	void *map;
+	size_t map_size;
+
+	/**
+	 * Serializes use of the face, including its active size and glyph slot.
+	 */
+	pthread_mutex_t lock;
+	struct font_face *next;
+};
+
+enum font_render_mode {
+	/**
+	 * Glyphs are 1-bit masks, most significant bit first.
+	 */
+	FONT_RENDER_MONO,
+
+	/**
+	 * Glyphs are 8-bit coverage masks with a pitch that is a multiple of
+	 * four bytes, suitable for use as a PIXMAN_a8 image.
+	 */
+	FONT_RENDER_GRAY,
+
+	/**
+	 * Glyphs are 8-bit signed distance fields, laid out like
+	 * FONT_RENDER_GRAY. A value of 128 is on the outline, and each step of
+	 * 128 / FONT_SDF_SPREAD is one pixel further inside (above) or outside
+	 * (below). These fonts are drawn with draw_text_scaled.
+	 */
+	FONT_RENDER_SDF,
 };
 
 struct glyph {
-	FT_Bitmap bitmap;
+	/**
+	 * The glyph bitmap in the font's render mode, stored in the font's glyph
+	 * atlas. Rows are pitch bytes apart.
+	 */
+	uint8_t *bitmap;
+	uint16_t width, height, pitch;
 
 	/**
 	 * The offset from the origin to the top left corner of the bitmap.
@@ -67,14 +299,238 @@ struct glyph {
 	 * The width to advance to the origin of the next character.
 	 */
 	uint16_t advance;
+
+	uint32_t index;
+
+	/**
+	 * The draw clock of the font (or the font it is a fallback for) when
+	 * the bitmap was last used.
+	 */
+	uint32_t last_used;
+
+	/**
+	 * The bitmap compressed with PackBits, row by row, while it is evicted
+	 * from the atlas, or NULL. Only the first width bytes of each row of an
+	 * 8-bit bitmap are stored.
+	 */
+	uint8_t *compressed;
+	uint32_t compressed_size;
+
+	/**
+	 * Glyphs are loaded in two steps, so that text can be measured without
+	 * rasterizing it. The metrics are just the advance, and the bitmap is
+	 * everything else. Each flag is set with a release store once its part
+	 * of the glyph has been filled in, after which that part is only
+	 * modified when the bitmap is evicted.
+	 */
+	bool metrics_loaded, bitmap_loaded;
+};
+
+struct glyph_atlas_page {
+	struct glyph_atlas_page *next;
+	size_t size, used;
+	uint8_t data[];
+};
+
+/**
+ * Storage for glyph bitmaps, packed into large pages. When the pages take up
+ * more than max_size bytes, the least recently used ones are freed, and the
+ * glyphs in them are unloaded.
+ */
+struct glyph_atlas {
+	struct glyph_atlas_page *pages;
+	size_t size, max_size;
+};
+
+struct font_cache_key {
+	uint64_t file_size;
+	int64_t mtime_sec, mtime_nsec;
+	double pixel_size, aspect;
+	uint32_t face_index, mode;
+};
+
+/**
+ * A file of glyphs rasterized by earlier runs, mapped read-only so that
+ * processes using the same font share it through the page cache. Glyphs
+ * rasterized during this run are written back when the font is closed.
+ */
+struct font_cache {
+	char *path, *font_path;
+	struct font_cache_key key;
+	void *map;
+	size_t map_size;
+	const struct font_cache_entry *entries;
+	uint32_t num_entries;
+	const uint8_t *data;
+	size_t data_size;
+	bool dirty;
+};
+
+struct char_cache_entry {
+	uint32_t character;
+	uint32_t value;
+};
+
+struct char_cache_table {
+	/**
+	 * The table this one replaced when the cache grew. Readers may still be
+	 * using it, so it is kept until the font is closed.
+	 */
+	struct char_cache_table *previous;
+	uint32_t size;
+	struct char_cache_entry entries[];
+};
+
+/**
+ * A cache of where characters were found in a font and its fallbacks. Each
+ * value holds the fallback slot in the bits above CHAR_SLOT_SHIFT (0 for the
+ * font itself) and the glyph index in the bits below it. Values are stored
+ * plus one, so that zero marks a character which has not been looked up yet.
+ * Characters missing from every font are only cached below
+ * CHAR_CACHE_DIRECT_SIZE, so the table only grows with the glyphs the fonts
+ * actually have.
+ *
+ * Lookups do not take the font lock. Values are only added, under the lock,
+ * and are published with release stores, as are the tables themselves.
+ */
+struct char_cache {
+	/**
+	 * Characters below CHAR_CACHE_DIRECT_SIZE, indexed by character.
+	 */
+	uint32_t *direct;
+
+	/**
+	 * An open-addressed hash table of all other characters.
+	 */
+	struct char_cache_table *table;
+	uint32_t count;
 };
 
 struct font {
 	struct wld_font base;
 
+	/**
+	 * A number unique to this font, for use as a cache key in place of its
+	 * address, which may be reused once the font is closed.
+	 */
+	uint64_t id;
+
 	struct wld_font_context *context;
+	struct font_face *font_face;
 	FT_Face face;
-	struct glyph **glyphs;
+	FT_Size size;
+	enum font_render_mode mode;
+	FT_Int32 load_flags;
+
+	/**
+	 * The character size set on the font's FT_Size, in 26.6 fixed point.
+	 */
+	FT_F26Dot6 char_width, char_height;
+
+	/**
+	 * Bounds on the ink of every glyph relative to its origin, in pixels,
+	 * so that glyphs outside the target can be skipped without loading
+	 * their bitmaps.
+	 */
+	struct box bounds;
+
+	/**
+	 * The number of times the font has been opened and not yet closed. This
+	 * and the fields below are protected by the context lock.
+	 */
+	uint32_t ref;
+
+	/**
+	 * Whether the font is in the context's font list, and if so, the name
+	 * it was opened with by wld_font_open_name, or NULL if it was opened with
+	 * wld_font_open_pattern.
+	 */
+	bool registered;
+	struct font_name *font_name;
+	struct font *next;
+
+	/**
+	 * The glyphs, indexed by glyph index. The table is split into pages of
+	 * GLYPH_PAGE_SIZE glyphs which are allocated when a glyph in their range
+	 * is first loaded. Pages are published with release stores, so glyphs
+	 * which are already loaded can be looked up without the font lock.
+	 */
+	struct glyph **glyph_pages;
+	uint32_t num_glyph_pages;
+	struct glyph_atlas atlas;
+
+	/**
+	 * Scratch space for converting bitmaps from FreeType.
+	 */
+	FT_Bitmap convert_bitmap;
+
+	struct char_cache char_cache;
+	struct font_cache cache;
+
+	/**
+	 * The fontconfig match the font was opened from.
+	 */
+	FcPattern *match;
+
+	/**
+	 * For an anti-aliased font, the same font rendered in monochrome, opened
+	 * the first time it is drawn by a renderer which can't blend glyphs.
+	 * Set once, with a release store, under the font lock.
+	 */
+	struct font *mono;
+
+	/**
+	 * Fonts to use for characters missing from this one, as sorted by
+	 * fontconfig, which belong to the font's name. Each fallback is opened
+	 * the first time it is needed.
+	 */
+	FcPattern *pattern;
+	FcFontSet *fallback_set;
+	struct font **fallbacks;
+	uint32_t num_fallbacks;
+
+	/**
+	 * Serializes loading glyphs and looking up characters that are not yet
+	 * cached, which modify the glyph table, character cache and fallbacks.
+	 * The face lock is taken inside it to use the face.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The font this is a fallback for, or NULL.
+	 */
+	struct font *parent;
+
+	/**
+	 * Held for reading while drawing with the font, so that glyph bitmaps
+	 * are not evicted while they are in use, and for writing while evicting
+	 * them from the font and its fallbacks.
+	 */
+	pthread_rwlock_t draw_lock;
+
+	/**
+	 * Incremented for every draw, and used to find the least recently used
+	 * glyph bitmaps.
+	 */
+	uint32_t clock;
+
+	/**
+	 * Set when the atlas of this font or one of its fallbacks grows past its
+	 * maximum size, so that bitmaps are evicted after the current draws.
+	 */
+	bool over_budget;
+
+	/**
+	 * The thread loading glyphs started by wld_font_prepare. Since a font
+	 * may be shared, starting and stopping it is serialized by the lock.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		pthread_t thread;
+		bool running, cancel;
+		struct wld_font_range *ranges;
+		uint32_t num_ranges;
+	} prepare;
 };
 
 struct wld_context_impl {
@@ -96,6 +552,7 @@ struct wld_renderer_impl {
 	uint32_t (*capabilities)(struct wld_renderer *renderer,
 	                         struct buffer *buffer);
 	bool (*set_target)(struct wld_renderer *renderer, struct buffer *buffer);
+	bool (*set_clip)(struct wld_renderer *renderer, pixman_region32_t *region);
 	void (*fill_rectangle)(struct wld_renderer *renderer,
 	                       uint32_t color, int32_t x, int32_t y,
 	                       uint32_t width, uint32_t height);
@@ -112,8 +569,25 @@ struct wld_renderer_impl {
 	                  struct font *font, uint32_t color,
 	                  int32_t x, int32_t y, const char *text, uint32_t length,
 	                  struct wld_extents *extents);
+	void (*draw_text_runs)(struct wld_renderer *renderer, struct font *font,
+	                       const struct wld_text_run *runs,
+	                       uint32_t num_runs);
+	void (*draw_cells)(struct wld_renderer *renderer, struct font *font,
+	                   int32_t x, int32_t y, const struct wld_cell *cells,
+	                   uint32_t columns, uint32_t rows);
+	void (*draw_text_scaled)(struct wld_renderer *renderer,
+	                         struct font *font, uint32_t color,
+	                         int32_t x, int32_t y, float scale,
+	                         const char *text, uint32_t length,
+	                         struct wld_extents *extents);
 	void (*flush)(struct wld_renderer *renderer);
 	void (*destroy)(struct wld_renderer *renderer);
+
+	/**
+	 * Whether the renderer can only draw monochrome glyphs, so anti-aliased
+	 * fonts are drawn with their monochrome versions.
+	 */
+	bool monochrome_text;
 };
 
 struct buffer {
@@ -150,7 +624,247 @@ struct buffer_socket_impl {
 	void (*destroy)(struct buffer_socket *socket);
 };
 
-bool font_ensure_glyph(struct font *font, FT_UInt glyph_index);
+static inline struct font *
+font_root(struct font *font)
+{
+	return font->parent ? font->parent : font;
+}
+
+/**
+ * Returns the glyph for the given character (in UTF-32) from the font or one
+ * of its fallbacks, loading its metrics if necessary, or NULL if no font has a
+ * glyph for it.
+ *
+ * @param glyph_font  If not NULL, set to the font containing the glyph
+ */
+struct glyph *font_char_glyph(struct font *font, uint32_t character,
+                              struct font **glyph_font);
+
+/**
+ * Returns the glyph with the given index, loading its metrics if necessary, or
+ * NULL if the glyph index is invalid or the glyph could not be loaded.
+ */
+struct glyph *font_ensure_glyph(struct font *font, FT_UInt glyph_index);
+
+/**
+ * Rasterize a glyph returned by one of the functions above, if it hasn't been
+ * already. Returns false if it could not be rasterized.
+ *
+ * The bitmap may only be used between font_begin_draw and font_end_draw.
+ */
+bool font_ensure_bitmap(struct font *font, struct glyph *glyph);
+
+/**
+ * Returns the monochrome version of an anti-aliased font, opening it if
+ * necessary, or the font itself if it isn't anti-aliased or the monochrome
+ * version couldn't be opened. The result belongs to the font.
+ */
+struct font *font_monochrome(struct font *font);
+
+/**
+ * Mark the start of a draw using glyph bitmaps from the font or its
+ * fallbacks. The bitmaps are not evicted until the matching font_end_draw.
+ */
+void font_begin_draw(struct font *font);
+
+/**
+ * Mark the end of a draw, evicting glyph bitmaps if the font or one of its
+ * fallbacks is over its budget and no other draws are in progress.
+ */
+void font_end_draw(struct font *font);
+
+/**
+ * Take another reference to the font, which is released with wld_font_close.
+ */
+void font_reference(struct font *font);
+
+/**
+ * Initialize a font's glyph cache with no file.
+ */
+void font_cache_initialize(struct font_cache *cache);
+
+/**
+ * Map the glyph cache file for the given font, if the font context has a
+ * cache directory. The cache must have been initialized.
+ */
+void font_cache_open(struct font *font, const char *font_path,
+                     uint32_t face_index, double pixel_size, double aspect);
+
+/**
+ * Load a glyph from the font's cache file. Returns false if it isn't cached.
+ */
+bool font_cache_load_glyph(struct font *font, FT_UInt glyph_index,
+                           struct glyph *glyph);
+
+/**
+ * Write back any newly rasterized glyphs and unmap the cache file.
+ */
+void font_cache_close(struct font *font);
+
+/**
+ * Returns the number of ASCII characters at the start of the given string.
+ */
+uint32_t utf8_ascii_length(const char *text, uint32_t length);
+
+/**
+ * Decode the UTF-8 character at the start of the given string, returning its
+ * length in bytes, or 0 if it is truncated or not valid UTF-8.
+ */
+uint32_t utf8_decode(const char *text, uint32_t length, uint32_t *character);
+
+/**
+ * Encode a character as UTF-8 into at most 4 bytes, returning the number of
+ * bytes written, or 0 if it is not a valid character.
+ */
+uint32_t utf8_encode(uint32_t character, char *text);
+
+void font_name_cache_initialize(struct font_name_cache *cache);
+void font_name_cache_finalize(struct font_name_cache *cache);
+
+/**
+ * Returns a reference to the resolved font name, using the name cache if
+ * possible, or NULL if fontconfig has no match for it.
+ */
+struct font_name *font_name_resolve(struct wld_font_context *context,
+                                    const char *name);
+
+void font_name_release(struct wld_font_context *context,
+                       struct font_name *font_name);
+
+void text_run_cache_initialize(struct text_run_cache *cache);
+void text_run_cache_finalize(struct text_run_cache *cache);
+
+/**
+ * Remove all runs for the given font from the run cache.
+ */
+void text_run_cache_remove_font(struct text_run_cache *cache,
+                                struct font *font);
+
+/**
+ * Returns a reference to the run for at most length bytes of the given UTF-8
+ * string, stopping at the first null character, or NULL if there was not
+ * enough memory to lay it out.
+ */
+struct text_run *font_text_run(struct font *font,
+                               const char *text, uint32_t length);
+
+void text_run_release(struct text_run *run);
+
+/**
+ * Returns whether a glyph from the font drawn with its origin at (x, y) may
+ * have ink inside the box.
+ */
+static inline bool
+font_glyph_visible(struct font *font, int32_t x, int32_t y,
+                   const struct box *box)
+{
+	return x + font->bounds.x2 > box->x1 && x + font->bounds.x1 < box->x2
+	       && y + font->bounds.y2 > box->y1 && y + font->bounds.y1 < box->y2;
+}
+
+/**
+ * Find the range of glyphs, from start up to but not including end, of a run
+ * drawn with its origin at (x, y) which may have ink inside the box. Returns
+ * false if none of them do.
+ */
+bool text_run_clip(struct text_run *run, int32_t x, int32_t y,
+                   const struct box *box, uint32_t *start, uint32_t *end);
+
+/**
+ * An 8-bit coverage mask for a run drawn from a font's signed distance
+ * fields. The mask's origin is at (x, y) relative to the run's origin, and it
+ * covers the glyphs from start up to but not including end.
+ */
+struct sdf_mask {
+	int32_t x, y;
+	uint32_t width, height, pitch;
+	uint32_t start, end;
+	uint8_t *data;
+};
+
+/**
+ * Find the position and size of the mask for a run from an SDF font drawn at
+ * (x, y) at the given scale, clipped to the box. Only the bitmaps of glyphs
+ * which may be inside the box are loaded. The mask's data is left for the
+ * caller to allocate. The font must be between font_begin_draw and
+ * font_end_draw.
+ */
+void sdf_measure_run(struct text_run *run, int32_t x, int32_t y, float scale,
+                     const struct box *box, struct sdf_mask *mask);
+
+/**
+ * Render a run into a mask measured by sdf_measure_run, whose data must be
+ * zeroed.
+ */
+void sdf_render_run(struct text_run *run, float scale, struct sdf_mask *mask);
+
+/**
+ * Returns the pitch of a glyph bitmap of the given width stored in a font
+ * with the given render mode. Monochrome rows have no extra bytes, and the
+ * others are padded to a multiple of 4 bytes so that renderers can use them
+ * directly as PIXMAN_a8 images.
+ */
+static inline uint32_t
+glyph_pitch(enum font_render_mode mode, uint32_t width)
+{
+	return mode == FONT_RENDER_MONO ? (width + 7) / 8 : (width + 3) & ~3;
+}
+
+/**
+ * Pack a row of 8-bit glyph coverage into a 1-bit mask, most significant bit
+ * first, for renderers that can only draw monochrome glyphs.
+ */
+static inline void
+glyph_pack_mono_row(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+	uint32_t index;
+
+	memset(dst, 0, (width + 7) / 8);
+
+	for (index = 0; index < width; ++index) {
+		if (src[index] & 0x80)
+			dst[index / 8] |= 0x80 >> (index % 8);
+	}
+}
+
+/**
+ * FNV-1a, starting from HASH_INITIAL or the hash of the preceding data.
+ */
+static inline uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *byte = data;
+
+	while (size--) {
+		hash ^= *byte++;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+static inline uint32_t
+cell_foreground(const struct wld_cell *cell)
+{
+	return cell->attributes & WLD_CELL_REVERSE ? cell->background
+	                                           : cell->foreground;
+}
+
+static inline uint32_t
+cell_background(const struct wld_cell *cell)
+{
+	return cell->attributes & WLD_CELL_REVERSE ? cell->foreground
+	                                           : cell->background;
+}
+
+/**
+ * Returns the offset of a cell's underline from the top of the cell.
+ */
+static inline uint32_t
+cell_underline_offset(struct font *font)
+{
+	return MIN(font->base.ascent + 1, font->base.height - 1);
+}
 
 /**
  * Returns the number of bytes per pixel for the given format.
@@ -206,6 +920,77 @@ void default_copy_region(struct wld_renderer *renderer, struct buffer *buffer,
                          int32_t dst_x, int32_t dst_y,
                          pixman_region32_t *region);
 
+/**
+ * This default draw_text_runs method is implemented in terms of draw_text.
+ */
+void default_draw_text_runs(struct wld_renderer *renderer, struct font *font,
+                            const struct wld_text_run *runs,
+                            uint32_t num_runs);
+
+/**
+ * This default draw_cells method is implemented in terms of fill_rectangle
+ * and draw_text_runs.
+ */
+void default_draw_cells(struct wld_renderer *renderer, struct font *font,
+                        int32_t x, int32_t y, const struct wld_cell *cells,
+                        uint32_t columns, uint32_t rows);
+
+/**
+ * Draw runs with the renderer's draw_text_runs, or for SDF fonts, which only
+ * draw_text_scaled can draw, each with draw_text_scaled.
+ */
+void draw_text_runs(struct wld_renderer *renderer, struct font *font,
+                    const struct wld_text_run *runs, uint32_t num_runs);
+
+/**
+ * This default draw_text_scaled method is implemented in terms of
+ * fill_rectangle, drawing the parts of the glyphs that are at least half
+ * covered.
+ */
+void default_draw_text_scaled(struct wld_renderer *renderer,
+                              struct font *font, uint32_t color,
+                              int32_t x, int32_t y, float scale,
+                              const char *text, uint32_t length,
+                              struct wld_extents *extents);
+
+/**
+ * Start deferring the renderer's drawing to a new display list.
+ */
+bool display_list_create(struct wld_renderer *renderer);
+
+/**
+ * Discard the recorded operations, and stop deferring the renderer's drawing.
+ */
+void display_list_destroy(struct wld_renderer *renderer);
+
+/**
+ * Draw the recorded operations, skipping those which are drawn over, and
+ * clear the display list.
+ */
+void display_list_execute(struct wld_renderer *renderer);
+
+/**
+ * Record operations in the renderer's display list. If an operation can't be
+ * recorded, the display list is executed and it is drawn right away.
+ */
+void display_list_fill_region(struct wld_renderer *renderer, uint32_t color,
+                              pixman_region32_t *region);
+void display_list_copy_region(struct wld_renderer *renderer,
+                              struct buffer *buffer,
+                              int32_t dst_x, int32_t dst_y,
+                              pixman_region32_t *region);
+void display_list_draw_text(struct wld_renderer *renderer, struct font *font,
+                            uint32_t color, int32_t x, int32_t y, float scale,
+                            const char *text, uint32_t length,
+                            struct wld_extents *extents);
+void display_list_draw_text_runs(struct wld_renderer *renderer,
+                                 struct font *font,
+                                 const struct wld_text_run *runs,
+                                 uint32_t num_runs);
+void display_list_draw_cells(struct wld_renderer *renderer, struct font *font,
+                             int32_t x, int32_t y, const struct wld_cell *cells,
+                             uint32_t columns, uint32_t rows);
+
 struct wld_surface *default_create_surface(struct wld_context *context,
                                            uint32_t width, uint32_t height,
                                            uint32_t format, uint32_t flags);
@@ -88,6 +88,20 @@ void wld_destroy_context(struct wld_context *context);
 
 /**** Font Handling ****/
 
+struct wld_font_range {
+	uint32_t first, last;
+};
+
+struct wld_run_cache_statistics {
+	uint64_t hits, misses;
+
+	/**
+	 * The number of runs in the cache, and the memory they use in bytes.
+	 */
+	uint32_t count;
+	size_t size;
+};
+
 struct wld_extents {
 	uint32_t advance;
 };
@@ -111,28 +125,136 @@ struct wld_font_context *wld_font_create_context();
 void wld_font_destroy_context(struct wld_font_context *context);
 
 /**
- * Open a new font from the given fontconfig match.
+ * Set the directory used to cache rasterized glyphs between runs.
+ *
+ * Fonts opened from a font file after this is called use a cache file in this
+ * directory, keyed by the font file, face, size and render mode. The file is
+ * mapped read-only, so processes using the same font share its glyphs, and
+ * glyphs rasterized by the font are written back to it when it is closed.
+ *
+ * @param path  The cache directory, created if necessary, or NULL to disable
+ *              the cache
+ */
+bool wld_font_set_cache_directory(struct wld_font_context *context,
+                                  const char *path);
+
+/**
+ * Set the maximum amount of memory, in bytes, used to cache the layout of
+ * recently drawn or measured strings. The least recently used strings are
+ * discarded when the cache is over this size.
+ *
+ * The default is 1 MiB. A size of 0 disables the cache.
+ */
+void wld_font_set_run_cache_size(struct wld_font_context *context,
+                                 size_t size);
+
+/**
+ * Get the number of hits and misses of the run cache so far, along with its
+ * current size.
+ */
+void wld_font_get_run_cache_statistics(struct wld_font_context *context,
+                                       struct wld_run_cache_statistics *stats);
+
+/**
+ * Open a font from the given fontconfig match.
+ *
+ * Glyphs are rendered with 8-bit anti-aliasing if FC_ANTIALIAS is set in the
+ * match, and as monochrome bitmaps otherwise. Renderers which can't blend,
+ * like the intel and nouveau blitters, draw anti-aliased fonts with a
+ * monochrome version of the font, whose hinting may make its text slightly
+ * narrower or wider than wld_font_text_extents measures.
+ *
+ * If a font with the same file, face, size and render mode is already open in
+ * the context, it is shared, along with its glyphs. Fonts of other sizes from
+ * the same file share the FreeType face.
  */
 struct wld_font *wld_font_open_pattern(struct wld_font_context *context,
                                        FcPattern *match);
 
 /**
- * Open a new font from a fontconfig pattern string.
+ * Open a font from the given fontconfig match whose glyphs are stored as
+ * signed distance fields, rasterized once at the match's pixel size.
+ *
+ * Text in these fonts can be drawn at any size with wld_draw_text_scaled, so
+ * the pixel size should be about as large as the text will usually be drawn.
+ * Returns NULL if FreeType is too old to render distance fields.
+ */
+struct wld_font *wld_font_open_pattern_sdf(struct wld_font_context *context,
+                                           FcPattern *match);
+
+/**
+ * Open a font from a fontconfig pattern string.
+ *
+ * Characters missing from the best match are drawn using the other fonts
+ * fontconfig considers suitable for the pattern, in order of preference.
+ *
+ * If a font with the same name is already open in the context, it is shared.
+ * Otherwise, the context remembers what fontconfig matched for recently used
+ * names until the fontconfig configuration changes, so opening the name again
+ * is quick.
  */
 struct wld_font *wld_font_open_name(struct wld_font_context *context,
                                     const char *name);
 
 /**
- * Close a font.
+ * Open a font from a fontconfig pattern string with glyphs stored as signed
+ * distance fields, as with wld_font_open_pattern_sdf.
+ */
+struct wld_font *wld_font_open_name_sdf(struct wld_font_context *context,
+                                        const char *name);
+
+/**
+ * Open a font from a fontconfig pattern string on a background thread, as
+ * with wld_font_open_name.
+ *
+ * The callback is called from the background thread once the font is open,
+ * or with a NULL font if it couldn't be opened. Destroying the font context
+ * waits for any fonts still being opened, but not for callbacks, so the
+ * callback may close the font and destroy the context itself.
+ */
+bool wld_font_open_name_async(struct wld_font_context *context,
+                              const char *name,
+                              void (*callback)(struct wld_font *font,
+                                               void *data),
+                              void *data);
+
+/**
+ * Close a font. A shared font is freed once every call that opened it has
+ * been matched by a call to this function.
  */
 void wld_font_close(struct wld_font *font);
 
 /**
- * Check if the given font has a particular character (in UTF-32), and if so,
- * load the glyph.
+ * Check if the given font or one of its fallbacks has a particular character
+ * (in UTF-32), and if so, load the glyph.
  */
 bool wld_font_ensure_char(struct wld_font *font, uint32_t character);
 
+/**
+ * Set the maximum amount of memory, in bytes, used for the rasterized glyphs
+ * of the font, and separately for each of its fallbacks.
+ *
+ * When a font's glyphs take up more than this, the least recently drawn ones
+ * are freed, and are rasterized again if they are needed. The default is
+ * SIZE_MAX, for no limit. Since fonts may be shared, this applies to every
+ * user of the font.
+ */
+void wld_font_set_glyph_cache_size(struct wld_font *font, size_t size);
+
+/**
+ * Start loading the glyphs for the given ranges of characters (in UTF-32,
+ * inclusive) on a background thread, so that they are ready by the time they
+ * are first drawn.
+ *
+ * The font may be used as usual while the glyphs are loading. If the font is
+ * still preparing glyphs from a previous call, this waits for it to finish
+ * first. Closing the last reference to the font stops any preparation in
+ * progress.
+ */
+bool wld_font_prepare(struct wld_font *font,
+                      const struct wld_font_range *ranges,
+                      uint32_t num_ranges);
+
 /**
  * Calculate the text extents of the given UTF-8 string.
  *
@@ -219,6 +341,13 @@ void wld_destroy_surface(struct wld_surface *surface);
 struct wld_renderer {
 	const struct wld_renderer_impl *const impl;
 	struct wld_buffer *target;
+	struct display_list *display_list;
+
+	/**
+	 * The region set with wld_set_clip_region, if clipped is set.
+	 */
+	pixman_region32_t clip;
+	bool clipped;
 };
 
 enum wld_capability {
@@ -237,6 +366,36 @@ bool wld_set_target_buffer(struct wld_renderer *renderer,
 bool wld_set_target_surface(struct wld_renderer *renderer,
                             struct wld_surface *surface);
 
+/**
+ * Set the region of the target, in target coordinates, outside of which
+ * fills, copies, text and cells leave the target unchanged.
+ *
+ * The clip stays in effect when the target changes, until it is replaced by
+ * another call, or removed by passing NULL. If it can't be set, the target is
+ * left unclipped.
+ *
+ * @return Whether or not the clip was set
+ */
+bool wld_set_clip_region(struct wld_renderer *renderer,
+                         pixman_region32_t *region);
+
+/**
+ * Set whether or not drawing with the renderer is deferred.
+ *
+ * While drawing is deferred, fills, copies, text and cells are recorded
+ * rather than drawn, and are drawn all at once by wld_flush or when the
+ * target changes. Before they are drawn, operations whose pixels are all
+ * filled or copied over by later ones are dropped, and consecutive fills of
+ * the same color are drawn together. Any fonts and buffers used by recorded
+ * operations stay open until they are drawn, but text and cells are copied,
+ * so they may be changed right away.
+ *
+ * Turning deferral off draws everything recorded so far.
+ *
+ * @return Whether or not the renderer is now deferring drawing
+ */
+bool wld_set_deferred(struct wld_renderer *renderer, bool deferred);
+
 void wld_fill_rectangle(struct wld_renderer *renderer, uint32_t color,
                         int32_t x, int32_t y, uint32_t width, uint32_t height);
 
@@ -266,6 +425,80 @@ void wld_draw_text(struct wld_renderer *renderer,
                    int32_t x, int32_t y, const char *text, uint32_t length,
                    struct wld_extents *extents);
 
+/**
+ * Draw a UTF-8 text string scaled from the font's size, as with
+ * wld_draw_text.
+ *
+ * Fonts opened with wld_font_open_name_sdf or wld_font_open_pattern_sdf are
+ * drawn from their distance fields, so they stay sharp at any scale. Other
+ * fonts are drawn at their own size.
+ *
+ * @param extents   If not NULL, will be initialized to the extents of the
+ *                  drawn text, after scaling
+ */
+void wld_draw_text_scaled(struct wld_renderer *renderer,
+                          struct wld_font *font, uint32_t color,
+                          int32_t x, int32_t y, float scale,
+                          const char *text, uint32_t length,
+                          struct wld_extents *extents);
+
+struct wld_text_run {
+	int32_t x, y;
+	uint32_t color;
+
+	/**
+	 * The UTF-8 text of the run, processed as in wld_draw_text.
+	 */
+	const char *text;
+	uint32_t length;
+};
+
+/**
+ * Draw a number of UTF-8 text strings, each with its own position and color,
+ * to the given buffer.
+ *
+ * This is faster than drawing the strings separately, since renderers may
+ * draw all the runs of the same color at once. For this reason, the order in
+ * which overlapping runs of different colors are drawn is not defined.
+ */
+void wld_draw_text_runs(struct wld_renderer *renderer, struct wld_font *font,
+                        const struct wld_text_run *runs, uint32_t num_runs);
+
+enum wld_cell_attribute {
+	WLD_CELL_UNDERLINE  = 1 << 0,
+
+	/**
+	 * Swap the foreground and background colors.
+	 */
+	WLD_CELL_REVERSE    = 1 << 1,
+};
+
+struct wld_cell {
+	/**
+	 * The character in the cell (in UTF-32), or 0 if the cell is empty.
+	 */
+	uint32_t character;
+	uint32_t foreground, background;
+	uint32_t attributes;
+};
+
+/**
+ * Draw a grid of character cells, such as the screen of a terminal, to the
+ * given buffer.
+ *
+ * Each cell is max_advance pixels wide and height pixels high in the given
+ * font. The background of every cell is filled, and then its character is
+ * drawn with the origin at the start of the cell, ascent pixels from the top.
+ * Characters are not moved by the advance of the previous ones, so this is
+ * meant for monospace fonts.
+ *
+ * @param x, y   The top left corner of the grid
+ * @param cells  The cells in the grid, one row after another
+ */
+void wld_draw_cells(struct wld_renderer *renderer, struct wld_font *font,
+                    int32_t x, int32_t y, const struct wld_cell *cells,
+                    uint32_t columns, uint32_t rows);
+
 void wld_flush(struct wld_renderer *renderer);
 
 #endif